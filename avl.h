@@ -10,13 +10,19 @@
 #ifndef _AVL_H_
 #define _AVL_H_
 
-#include "system.h"
+#include "scm.h"
 
 struct avl;
 
 typedef void (*avl_fnc_t)(void *arg, const char *item, uint64_t count);
 
-struct avl *avl_open(const char *pathname, int truncate);
+enum avl_layout
+{
+    AVL_LAYOUT_INORDER,
+    AVL_LAYOUT_BFS
+};
+
+struct avl *avl_open(const char *pathname, int truncate, const struct scm_options *options);
 
 void avl_close(struct avl *avl);
 
@@ -28,6 +34,8 @@ uint64_t avl_exists(const struct avl *avl, const char *item);
 
 void avl_traverse(const struct avl *avl, avl_fnc_t fnc, void *arg);
 
+int avl_compact(struct avl *avl, enum avl_layout layout);
+
 uint64_t avl_items(const struct avl *avl);
 
 uint64_t avl_unique(const struct avl *avl);
@@ -36,6 +44,34 @@ size_t avl_scm_utilized(const struct avl *avl);
 
 size_t avl_scm_capacity(const struct avl *avl);
 
+size_t avl_scm_free_bytes(const struct avl *avl);
+
+size_t avl_scm_free_blocks(const struct avl *avl);
+
+size_t avl_scm_largest_free(const struct avl *avl);
+
+size_t avl_scm_footprint(const struct avl *avl);
+
+size_t avl_scm_punch(struct avl *avl);
+
+void avl_scm_stats(struct avl *avl, struct scm_stats *stats);
+
+void avl_scm_pool(struct avl *avl, struct scm_pool *stats);
+
+int avl_scm_dax(const struct avl *avl);
+
+int avl_checkpoint(struct avl *avl, struct scm_checkpoint *stats);
+
+int avl_barrier(struct avl *avl);
+
+int avl_snapshot(struct avl *avl, const char *pathname, struct scm_snapshot *stats);
+
+int avl_snapshot_wait(struct avl *avl, struct scm_snapshot *stats);
+
+int avl_export(struct avl *avl, const char *pathname, struct scm_export *stats);
+
+int avl_import(const char *from, const char *pathname, size_t size, struct scm_export *stats);
+
 #endif /* _AVL_H_ */
 
 /* ref: https://www.educative.io/answers/how-to-delete-a-node-from-an-avl-tree */
\ No newline at end of file
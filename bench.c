@@ -0,0 +1,1360 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * bench.c
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bench.h"
+
+/**
+ * Needs:
+ *   clock_gettime()
+ *   mkstemp()
+ *   pthread_create()
+ *   getrusage()
+ *   perf_event_open()
+ */
+
+#define ROUNDS 10        /* passes over the stored words per lookup benchmark */
+#define THREADS 16       /* upper bound of the thread scaling benchmark */
+#define OPS 1000000      /* scm_malloc() or scm_free() calls per thread */
+#define LIVE 512         /* blocks a thread keeps allocated at most */
+#define WORDS 20000      /* distinct words of the update benchmark */
+#define BATCH 64         /* operations per durable group commit */
+#define STAGED 100000    /* scratch objects per batch of the arena benchmark */
+#define BATCHES 20       /* batches of the arena benchmark */
+#define HUGE_DIR "/dev/shm" /* tmpfs, where files get transparent huge pages */
+#define PROBES 100000    /* timed lookups per backend of the pool benchmark */
+#define HOT 64           /* words of the pool benchmark's working set that fits */
+#define CALLOCS 400      /* free, punch and scm_calloc() rounds per alignment */
+#define LONGS 50         /* words too long for a slab slot per compaction check */
+
+struct words
+{
+    uint64_t n;
+    char **item;
+};
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        EXIT("clock_gettime()");
+    }
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+collect(void *arg, const char *item, uint64_t count)
+{
+    struct words *words;
+
+    UNUSED(count);
+
+    words = (struct words *)arg;
+    words->item[words->n++] = (char *)item;
+}
+
+/**
+ * Copies every stored word into DRAM, so that the keys being looked up
+ * do not warm the SCM pages the descent is about to touch, and permutes
+ * them so that consecutive lookups do not share a path.
+ */
+
+static int
+words_open(struct avl *avl, struct words *words)
+{
+    uint64_t i, j;
+    char *t;
+
+    memset(words, 0, sizeof(struct words));
+    if (!avl_unique(avl))
+    {
+        printf("error: nothing to benchmark, load some words first\n");
+        return -1;
+    }
+    if (!(words->item = malloc(avl_unique(avl) * sizeof(char *))))
+    {
+        TRACE("out of memory");
+        return -1;
+    }
+    avl_traverse(avl, collect, words);
+    for (i = 0; i < words->n; ++i)
+    {
+        if (!(t = malloc(safe_strlen(words->item[i]) + 1)))
+        {
+            TRACE("out of memory");
+            words->n = i;
+            return -1;
+        }
+        words->item[i] = strcpy(t, words->item[i]);
+    }
+    srand(1);
+    for (i = words->n - 1; 0 < i; --i)
+    {
+        j = (uint64_t)rand() % (i + 1);
+        t = words->item[i];
+        words->item[i] = words->item[j];
+        words->item[j] = t;
+    }
+    return 0;
+}
+
+static void
+words_close(struct words *words)
+{
+    uint64_t i;
+
+    for (i = 0; i < words->n; ++i)
+    {
+        FREE(words->item[i]);
+    }
+    FREE(words->item);
+}
+
+/**
+ * Times avl_exists() over every stored word. Each visited node costs two
+ * offset-to-pointer translations (child and key), so comparing runs of
+ * this benchmark across builds measures the price of relocatable regions.
+ */
+
+static int
+lookup(struct avl *avl)
+{
+    struct words words;
+    uint64_t i, r, t, hits;
+
+    if (words_open(avl, &words))
+    {
+        words_close(&words);
+        return 0;
+    }
+    hits = 0;
+    t = now();
+    for (r = 0; r < ROUNDS; ++r)
+    {
+        for (i = 0; i < words.n; ++i)
+        {
+            hits += avl_exists(avl, words.item[i]) ? 1 : 0;
+        }
+    }
+    t = now() - t;
+    printf("\n-- bench lookup -- \n"
+           "  lookups  : %lu (%lu hits)\n"
+           "  time     : %.3f ms\n"
+           "  latency  : %.1f ns/lookup\n"
+           "\n",
+           (unsigned long)(ROUNDS * words.n),
+           (unsigned long)hits,
+           t / 1e6,
+           (double)t / (double)(ROUNDS * words.n));
+    words_close(&words);
+    return 0;
+}
+
+static int
+scratch(char *pathname)
+{
+    int fd;
+
+    if (0 > (fd = mkstemp(pathname)))
+    {
+        TRACE("mkstemp() failed");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* deletes a scratch store and its write-ahead log */
+
+static void
+scratch_delete(const char *pathname)
+{
+    char name[64];
+    int i;
+
+    file_delete(pathname);
+    for (i = 0; i < 2; ++i)
+    {
+        safe_sprintf(name, sizeof(name), "%s.wal.%d", pathname, i);
+        file_delete(name);
+    }
+}
+
+struct worker
+{
+    pthread_t thread;
+    struct scm *scm;
+    uint64_t seed;
+    int failed;
+};
+
+/* a churn of small allocations as tree nodes and keys would produce */
+
+static void *
+churn(void *arg)
+{
+    struct worker *worker;
+    void *live[LIVE];
+    uint64_t i, j, x;
+
+    worker = (struct worker *)arg;
+    memset(live, 0, sizeof(live));
+    x = worker->seed;
+    for (i = 0; i < OPS; ++i)
+    {
+        x ^= x << 13; /* xorshift64 */
+        x ^= x >> 7;
+        x ^= x << 17;
+        j = x % LIVE;
+        if (live[j])
+        {
+            scm_free(worker->scm, live[j]);
+            live[j] = NULL;
+        }
+        else if (!(live[j] = scm_malloc(worker->scm, 8 + (size_t)(x >> 32) % 249)))
+        {
+            worker->failed = 1;
+            break;
+        }
+    }
+    for (j = 0; j < LIVE; ++j)
+    {
+        if (live[j])
+        {
+            scm_free(worker->scm, live[j]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Measures scm_malloc()/scm_free() throughput for 1, 2, 4, ... threads
+ * sharing one region. The region is a scratch file, not the open store.
+ */
+
+static int
+threads(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    struct worker workers[THREADS];
+    struct scm *scm;
+    uint64_t t, base;
+    long cpus;
+    int n, i;
+
+    UNUSED(avl);
+
+    if (scratch(pathname))
+    {
+        return 0;
+    }
+    if (!(scm = scm_open(pathname, 1, NULL)))
+    {
+        file_delete(pathname);
+        TRACE(0);
+        return 0;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("\n-- bench threads (%ld cpus, %d ops/thread) -- \n", cpus, OPS);
+    base = 0;
+    for (n = 1; n <= THREADS; n *= 2)
+    {
+        memset(workers, 0, sizeof(workers));
+        t = now();
+        for (i = 0; i < n; ++i)
+        {
+            workers[i].scm = scm;
+            workers[i].seed = 88172645463325252 + (uint64_t)i;
+            if (pthread_create(&workers[i].thread, NULL, churn, &workers[i]))
+            {
+                EXIT("pthread_create()");
+            }
+        }
+        for (i = 0; i < n; ++i)
+        {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].failed)
+            {
+                printf("error: allocation failed\n");
+            }
+        }
+        t = now() - t;
+        base = base ? base : t;
+        printf("  %2d threads : %7.2f Mops/s  (%.2fx)\n",
+               n,
+               (double)n * OPS * 1e3 / (double)t,
+               (double)n * (double)base / (double)t);
+    }
+    printf("\n");
+    scm_close(scm);
+    file_delete(pathname);
+    return 0;
+}
+
+/**
+ * Times avl_insert() and avl_delete() of WORDS distinct words in scratch
+ * stores opened with each transaction guarantee, so that the cost of the
+ * undo log, and of ordered flushes on top of it, shows per operation.
+ * The group mode makes operations durable BATCH at a time instead, with
+ * scm_barrier() on a store with a background flusher. The wal mode makes
+ * each one durable through the write-ahead log.
+ */
+
+static int
+update(struct avl *avl)
+{
+    const struct
+    {
+        const char *name;
+        enum scm_atomicity atomicity;
+        int words;
+        int batch; /* operations per avl_barrier(), 0 for none */
+        int wal;
+    } MODES[] = {
+        {"none", SCM_ATOMIC_NONE, WORDS, 0, 0},
+        {"log", SCM_ATOMIC_LOG, WORDS, 0, 0},
+        {"sync", SCM_ATOMIC_SYNC, WORDS / 20, 0, 0},
+        {"group", SCM_ATOMIC_LOG, WORDS, BATCH, 0},
+        {"wal", SCM_ATOMIC_LOG, WORDS, 1, 1}};
+    struct scm_options options;
+    char pathname[32], word[32];
+    struct avl *store;
+    uint64_t t, u;
+    int m, i;
+
+    UNUSED(avl);
+
+    printf("\n-- bench update -- \n");
+    for (m = 0; m < (int)ARRAY_SIZE(MODES); ++m)
+    {
+        safe_sprintf(pathname, sizeof(pathname), "/tmp/scm-bench-XXXXXX");
+        if (scratch(pathname))
+        {
+            return 0;
+        }
+        memset(&options, 0, sizeof(options));
+        options.atomicity = MODES[m].atomicity;
+        options.flush_ms = MODES[m].batch ? 100 : 0;
+        options.wal = MODES[m].wal;
+        if (!(store = avl_open(pathname, 1, &options)))
+        {
+            scratch_delete(pathname);
+            TRACE(0);
+            return 0;
+        }
+        t = now();
+        for (i = 0; i < MODES[m].words; ++i)
+        {
+            safe_sprintf(word, sizeof(word), "w%x", (unsigned)(i * 2654435761u));
+            avl_insert(store, word);
+            if (MODES[m].batch && !((i + 1) % MODES[m].batch))
+            {
+                avl_barrier(store);
+            }
+        }
+        t = now() - t;
+        u = now();
+        for (i = 0; i < MODES[m].words; ++i)
+        {
+            safe_sprintf(word, sizeof(word), "w%x", (unsigned)(i * 2654435761u));
+            avl_delete(store, word);
+            if (MODES[m].batch && !((i + 1) % MODES[m].batch))
+            {
+                avl_barrier(store);
+            }
+        }
+        u = now() - u;
+        printf("  %-5s : %8.2f us/insert %8.2f us/delete\n",
+               MODES[m].name,
+               (double)t / 1e3 / MODES[m].words,
+               (double)u / 1e3 / MODES[m].words);
+        avl_close(store);
+        scratch_delete(pathname);
+    }
+    printf("\n");
+    return 0;
+}
+
+static void
+faults(long *minor, long *major)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage))
+    {
+        EXIT("getrusage()");
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+/**
+ * Copies the stored words into a scratch store, then reopens it once per
+ * prefault policy and times the open followed by one pass of lookups, as
+ * after a restart. Page faults come from getrusage(); with the file in
+ * the page cache they are minor, each one a page mapped on first touch.
+ */
+
+static int
+restart(struct avl *avl)
+{
+    const struct
+    {
+        const char *name;
+        enum scm_prefault prefault;
+        enum scm_access access;
+    } POLICIES[] = {
+        {"none", SCM_PREFAULT_NONE, SCM_ACCESS_NORMAL},
+        {"random", SCM_PREFAULT_NONE, SCM_ACCESS_RANDOM},
+        {"willneed", SCM_PREFAULT_WILLNEED, SCM_ACCESS_NORMAL},
+        {"populate", SCM_PREFAULT_POPULATE, SCM_ACCESS_NORMAL},
+        {"utilized", SCM_PREFAULT_UTILIZED, SCM_ACCESS_RANDOM}};
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    struct scm_options options;
+    struct words words;
+    struct avl *store;
+    long minor[3], major[3];
+    uint64_t i, t, u;
+    int p;
+
+    if (words_open(avl, &words) || scratch(pathname))
+    {
+        words_close(&words);
+        return 0;
+    }
+    if (!(store = avl_open(pathname, 1, NULL)))
+    {
+        file_delete(pathname);
+        words_close(&words);
+        TRACE(0);
+        return 0;
+    }
+    for (i = 0; i < words.n; ++i)
+    {
+        avl_insert(store, words.item[i]);
+    }
+    avl_close(store);
+
+    printf("\n-- bench restart (%lu words) -- \n"
+           "  policy   :  open ms  faults | first pass ns/lookup  faults\n",
+           (unsigned long)words.n);
+    for (p = 0; p < (int)ARRAY_SIZE(POLICIES); ++p)
+    {
+        memset(&options, 0, sizeof(options));
+        options.prefault = POLICIES[p].prefault;
+        options.access = POLICIES[p].access;
+        faults(&minor[0], &major[0]);
+        t = now();
+        if (!(store = avl_open(pathname, 0, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        t = now() - t;
+        faults(&minor[1], &major[1]);
+        u = now();
+        for (i = 0; i < words.n; ++i)
+        {
+            avl_exists(store, words.item[i]);
+        }
+        u = now() - u;
+        faults(&minor[2], &major[2]);
+        avl_close(store);
+        printf("  %-8s : %8.3f %7ld | %20.1f %7ld\n",
+               POLICIES[p].name,
+               t / 1e6,
+               (minor[1] - minor[0]) + (major[1] - major[0]),
+               (double)u / (double)words.n,
+               (minor[2] - minor[1]) + (major[2] - major[1]));
+    }
+    printf("\n");
+    file_delete(pathname);
+    words_close(&words);
+    return 0;
+}
+
+/* dTLB load misses of the calling thread, -1 where there is no PMU */
+
+static int
+tlb_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long
+tlb_read(int fd)
+{
+    uint64_t count;
+
+    if ((0 > fd) || (sizeof(count) != read(fd, &count, sizeof(count))))
+    {
+        return -1;
+    }
+    return (long)count;
+}
+
+/* kB of the process mapped with huge pages, PMD-mapped or hugetlb */
+
+static long
+huge_kb(void)
+{
+    char line[128];
+    FILE *file;
+    long kb, n;
+
+    kb = 0;
+    if ((file = fopen("/proc/self/smaps_rollup", "r")))
+    {
+        while (fgets(line, sizeof(line), file))
+        {
+            if ((1 == sscanf(line, "FilePmdMapped: %ld", &n)) ||
+                (1 == sscanf(line, "ShmemPmdMapped: %ld", &n)))
+            {
+                kb += n;
+            }
+        }
+        fclose(file);
+    }
+    return kb;
+}
+
+/**
+ * Times ROUNDS passes of lookups over a copy of the stored words, mapped
+ * with base pages and then with SCM_PAGES_HUGE. The copies live in
+ * HUGE_DIR: transparent huge pages only back files on tmpfs, and on a
+ * hugetlbfs mount both runs use huge pages.
+ */
+
+static int
+huge(struct avl *avl)
+{
+    const struct
+    {
+        const char *name;
+        enum scm_pages pages;
+    } MODES[] = {
+        {"base", SCM_PAGES_BASE},
+        {"huge", SCM_PAGES_HUGE}};
+    char pathname[] = HUGE_DIR "/scm-bench-XXXXXX";
+    struct scm_options options;
+    struct words words;
+    struct avl *store;
+    uint64_t i, r, t;
+    long misses;
+    int m, fd;
+
+    if (words_open(avl, &words))
+    {
+        words_close(&words);
+        return 0;
+    }
+    fd = tlb_open();
+    printf("\n-- bench huge (%lu words, %s) -- \n",
+           (unsigned long)words.n,
+           HUGE_DIR);
+    for (m = 0; m < (int)ARRAY_SIZE(MODES); ++m)
+    {
+        memset(&options, 0, sizeof(options));
+        options.pages = MODES[m].pages;
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        if (scratch(pathname) || !(store = avl_open(pathname, 1, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        for (i = 0; i < words.n; ++i)
+        {
+            avl_insert(store, words.item[i]);
+        }
+        misses = tlb_read(fd);
+        t = now();
+        for (r = 0; r < ROUNDS; ++r)
+        {
+            for (i = 0; i < words.n; ++i)
+            {
+                avl_exists(store, words.item[i]);
+            }
+        }
+        t = now() - t;
+        misses = (0 > misses) ? -1 : (tlb_read(fd) - misses);
+        if (0 > misses)
+        {
+            printf("  %-4s : %8.1f ns/lookup  dTLB misses n/a  %ld kB huge\n",
+                   MODES[m].name,
+                   (double)t / (double)(ROUNDS * words.n),
+                   huge_kb());
+        }
+        else
+        {
+            printf("  %-4s : %8.1f ns/lookup  %6.3f dTLB misses/lookup  %ld kB huge\n",
+                   MODES[m].name,
+                   (double)t / (double)(ROUNDS * words.n),
+                   (double)misses / (double)(ROUNDS * words.n),
+                   huge_kb());
+        }
+        avl_close(store);
+        file_delete(pathname);
+    }
+    printf("\n");
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    words_close(&words);
+    return 0;
+}
+
+/**
+ * Frees runs of page-sized blocks in a scratch SCM_ALLOC_FIT region,
+ * punches them, and takes them back with scm_calloc() at alignments below
+ * and above the page size, which move the payload of a reused block to
+ * anywhere in or past its hole. Checks that every byte comes back zero
+ * and reports the rate of the calls, which only clear what lies outside
+ * the punched pages.
+ */
+
+static int
+cleared(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    const size_t ALIGNS[] = {0, 64, 4096, 16384};
+    struct scm_options options;
+    struct scm *scm;
+    char *block[8];
+    size_t page, n, k, bytes;
+    uint64_t t, u;
+    int a, r, i, bad, failed;
+
+    UNUSED(avl);
+
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    printf("\n-- bench calloc (%d rounds of 8 blocks) -- \n", CALLOCS);
+    for (a = 0; a < (int)ARRAY_SIZE(ALIGNS); ++a)
+    {
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        memset(&options, 0, sizeof(options));
+        options.allocator = SCM_ALLOC_FIT;
+        options.alignment = ALIGNS[a];
+        if (scratch(pathname) || !(scm = scm_open(pathname, 1, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        bytes = t = 0;
+        bad = failed = 0;
+        for (r = 0; (r < CALLOCS) && !failed; ++r)
+        {
+            for (i = 0; i < 8; ++i)
+            {
+                n = page * (size_t)(1 + (r + i) % 5) + (size_t)((r * 37 + i * 11) % 64) * 8;
+                if (!(block[i] = scm_malloc(scm, n)))
+                {
+                    failed = 1;
+                    break;
+                }
+                memset(block[i], 0xff, n);
+            }
+            /* keeps the run from merging into the bump tail */
+            failed |= !scm_malloc(scm, 24);
+            while (i)
+            {
+                scm_free(scm, block[--i]);
+            }
+            scm_punch(scm);
+            for (i = 0; (i < 8) && !failed; ++i)
+            {
+                n = page * (size_t)(1 + (r + i * 3) % 5) - (size_t)((r * 13 + i) % 80) * 8;
+                u = now();
+                if (!(block[i] = scm_calloc(scm, n, 1)))
+                {
+                    failed = 1;
+                    break;
+                }
+                t += now() - u;
+                for (k = 0; k < n; ++k)
+                {
+                    bad |= block[i][k];
+                }
+                memset(block[i], 0xff, n);
+                bytes += n;
+            }
+            while (i)
+            {
+                scm_free(scm, block[--i]);
+            }
+        }
+        printf("  align %5lu : %8.1f MB/s  %s\n",
+               (unsigned long)ALIGNS[a],
+               (double)bytes * 1e3 / (double)(t ? t : 1),
+               failed ? "(allocation failed)" : (bad ? "NOT ZEROED" : "zeroed"));
+        scm_close(scm);
+        file_delete(pathname);
+    }
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Times ROUNDS passes of lookups over copies of the stored words. A node
+ * whose key fits in SLOT bytes with it (keys up to 24 bytes) takes a
+ * whole 64-byte slab slot, which never straddles a cache line: the first
+ * row. Each word is then lengthened by TAIL, past that, so that its node
+ * is placed by scm_malloc() at the default block alignment: with 8 bytes
+ * a 40-byte node following an odd-length key straddles two cache lines
+ * more often than not; with 64 it never does, at the cost of the padding.
+ */
+
+static int
+align(struct avl *avl)
+{
+    const size_t ALIGNMENTS[] = {0, 8, 16, 64};
+    const char TAIL[] = "-0123456789abcdefghijklm";
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    struct scm_options options;
+    struct words words;
+    struct avl *store;
+    char **item;
+    uint64_t i, r, t;
+    int a;
+
+    if (words_open(avl, &words))
+    {
+        words_close(&words);
+        return 0;
+    }
+    if (!(item = malloc(words.n * sizeof(char *))))
+    {
+        TRACE("out of memory");
+        words_close(&words);
+        return 0;
+    }
+    for (i = 0; i < words.n; ++i)
+    {
+        if (!(item[i] = malloc(safe_strlen(words.item[i]) + sizeof(TAIL))))
+        {
+            TRACE("out of memory");
+            break;
+        }
+        strcat(strcpy(item[i], words.item[i]), TAIL);
+    }
+    printf("\n-- bench align (%lu words) -- \n",
+           (unsigned long)words.n);
+    for (a = 0; (i == words.n) && (a < (int)ARRAY_SIZE(ALIGNMENTS)); ++a)
+    {
+        memset(&options, 0, sizeof(options));
+        options.alignment = ALIGNMENTS[a];
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        if (scratch(pathname) || !(store = avl_open(pathname, 1, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        /* the first pass keeps the words as they are, in slabs */
+        for (i = 0; i < words.n; ++i)
+        {
+            avl_insert(store, a ? item[i] : words.item[i]);
+        }
+        t = now();
+        for (r = 0; r < ROUNDS; ++r)
+        {
+            for (i = 0; i < words.n; ++i)
+            {
+                avl_exists(store, a ? item[i] : words.item[i]);
+            }
+        }
+        t = now() - t;
+        if (a)
+        {
+            printf("  %2lu bytes : ", (unsigned long)ALIGNMENTS[a]);
+        }
+        else
+        {
+            printf("  slab     : ");
+        }
+        printf("%8.1f ns/lookup  %8.3f MB utilized\n",
+               (double)t / (double)(ROUNDS * words.n),
+               avl_scm_utilized(store) / 1e6);
+        avl_close(store);
+        file_delete(pathname);
+    }
+    printf("\n");
+    while (i)
+    {
+        --i;
+        FREE(item[i]);
+    }
+    FREE(item);
+    words_close(&words);
+    return 0;
+}
+
+/**
+ * Compacts scratch trees whose short-key nodes fill their 63-slot slabs
+ * exactly, or one short of that or past it. LONGS longer words sort after
+ * them, so that the last slab the copy fills is not followed by another.
+ * The compact tree is then laid out anew breadth first, a copy as large
+ * as what it replaces. More words go in after that, then every word is
+ * looked up. Checks that none is lost and reports the time of each
+ * compaction.
+ */
+
+static int
+compacted(struct avl *avl)
+{
+    const uint64_t SHORTS[] = {62, 63, 126, 127};
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    char item[64];
+    struct avl *store;
+    uint64_t i, t[2];
+    int s, bad, failed;
+
+    UNUSED(avl);
+
+    printf("\n-- bench compact (%d long words) -- \n", LONGS);
+    for (s = 0; s < (int)ARRAY_SIZE(SHORTS); ++s)
+    {
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        if (scratch(pathname) || !(store = avl_open(pathname, 1, NULL)))
+        {
+            TRACE(0);
+            break;
+        }
+        for (i = 0; i < SHORTS[s]; ++i)
+        {
+            safe_sprintf(item, sizeof(item), "s%04lu", (unsigned long)i);
+            avl_insert(store, item);
+        }
+        for (i = 0; i < LONGS; ++i)
+        {
+            safe_sprintf(item, sizeof(item), "z%04lu-0123456789abcdefghijklmnopqrstuvwxyz", (unsigned long)i);
+            avl_insert(store, item);
+        }
+        t[0] = now();
+        failed = avl_compact(store, AVL_LAYOUT_INORDER);
+        t[1] = now();
+        t[0] = t[1] - t[0];
+        failed |= avl_compact(store, AVL_LAYOUT_BFS);
+        t[1] = now() - t[1];
+        for (i = 0; i < SHORTS[s]; ++i)
+        {
+            safe_sprintf(item, sizeof(item), "t%04lu", (unsigned long)i);
+            avl_insert(store, item);
+        }
+        bad = (avl_unique(store) != 2 * SHORTS[s] + LONGS);
+        for (i = 0; i < SHORTS[s]; ++i)
+        {
+            safe_sprintf(item, sizeof(item), "s%04lu", (unsigned long)i);
+            bad |= !avl_exists(store, item);
+            safe_sprintf(item, sizeof(item), "t%04lu", (unsigned long)i);
+            bad |= !avl_exists(store, item);
+        }
+        for (i = 0; i < LONGS; ++i)
+        {
+            safe_sprintf(item, sizeof(item), "z%04lu-0123456789abcdefghijklmnopqrstuvwxyz", (unsigned long)i);
+            bad |= !avl_exists(store, item);
+        }
+        printf("  %3lu short : %8.1f us inorder  %8.1f us bfs  %s\n",
+               (unsigned long)SHORTS[s],
+               t[0] / 1e3,
+               t[1] / 1e3,
+               failed ? "(compaction failed)" : (bad ? "WORDS LOST" : "consistent"));
+        avl_close(store);
+        file_delete(pathname);
+    }
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Stages batches of small scratch objects in a scratch region and throws
+ * each batch away, once object by object with scm_malloc()/scm_free() and
+ * once with an arena and scm_arena_reset(), then with punching as well.
+ */
+
+static int
+arena(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    struct scm_arena *arena;
+    void **live;
+    struct scm *scm;
+    uint64_t t[3], i, j, x;
+    int m;
+
+    UNUSED(avl);
+
+    if (!(live = malloc(STAGED * sizeof(void *))))
+    {
+        TRACE("out of memory");
+        return 0;
+    }
+    if (scratch(pathname))
+    {
+        free(live);
+        return 0;
+    }
+    if (!(scm = scm_open(pathname, 1, NULL)) || !(arena = scm_arena_open(scm, 0)))
+    {
+        scm_close(scm);
+        file_delete(pathname);
+        free(live);
+        TRACE(0);
+        return 0;
+    }
+    printf("\n-- bench arena (%d batches of %d objects) -- \n", BATCHES, STAGED);
+    for (m = 0; m < 3; ++m)
+    {
+        x = 88172645463325252;
+        t[m] = now();
+        for (i = 0; i < BATCHES; ++i)
+        {
+            for (j = 0; j < STAGED; ++j)
+            {
+                x ^= x << 13; /* xorshift64 */
+                x ^= x >> 7;
+                x ^= x << 17;
+                live[j] = m ? scm_arena_alloc(arena, 8 + (size_t)(x >> 32) % 249)
+                            : scm_malloc(scm, 8 + (size_t)(x >> 32) % 249);
+                if (!live[j])
+                {
+                    EXIT("allocation failed");
+                }
+                memset(live[j], 0, 8);
+            }
+            if (m)
+            {
+                scm_arena_reset(arena, 2 == m);
+                continue;
+            }
+            for (j = 0; j < STAGED; ++j)
+            {
+                scm_free(scm, live[j]);
+            }
+        }
+        t[m] = now() - t[m];
+    }
+    printf("  malloc/free   : %7.1f ns/object\n"
+           "  arena reset   : %7.1f ns/object  (%.1fx)\n"
+           "  ... punched   : %7.1f ns/object  (%.1fx)\n"
+           "\n",
+           (double)t[0] / (BATCHES * STAGED),
+           (double)t[1] / (BATCHES * STAGED),
+           (double)t[0] / (double)t[1],
+           (double)t[2] / (BATCHES * STAGED),
+           (double)t[0] / (double)t[2]);
+    scm_arena_close(arena, 0);
+    scm_close(scm);
+    file_delete(pathname);
+    free(live);
+    return 0;
+}
+
+struct writer
+{
+    pthread_t thread;
+    struct avl *store;
+    pthread_mutex_t *lock;
+    int id, n;
+    int failed;
+};
+
+/* inserts words one at a time, each durable before the next */
+
+static void *
+write_durably(void *arg)
+{
+    struct writer *writer;
+    char word[32];
+    int i;
+
+    writer = (struct writer *)arg;
+    for (i = 0; i < writer->n; ++i)
+    {
+        safe_sprintf(word, sizeof(word), "w%d.%x", writer->id, (unsigned)(i * 2654435761u));
+        pthread_mutex_lock(writer->lock);
+        writer->failed |= avl_insert(writer->store, word);
+        pthread_mutex_unlock(writer->lock);
+        writer->failed |= avl_barrier(writer->store);
+    }
+    return NULL;
+}
+
+/**
+ * Measures durable inserts per second through the write-ahead log for 1,
+ * 2, 4, ... threads sharing one store: the tree is updated under a lock,
+ * the wait for durability is outside of it, so that the threads waiting
+ * at once share an fdatasync().
+ */
+
+static int
+wal(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    struct writer writers[THREADS];
+    struct scm_options options;
+    pthread_mutex_t lock;
+    struct avl *store;
+    uint64_t t;
+    int n, i;
+
+    UNUSED(avl);
+
+    printf("\n-- bench wal (%d durable inserts) -- \n", WORDS);
+    pthread_mutex_init(&lock, NULL);
+    for (n = 1; n <= THREADS; n *= 2)
+    {
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        memset(&options, 0, sizeof(options));
+        options.wal = 1;
+        options.flush_ms = 100;
+        if (scratch(pathname) || !(store = avl_open(pathname, 1, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        memset(writers, 0, sizeof(writers));
+        t = now();
+        for (i = 0; i < n; ++i)
+        {
+            writers[i].store = store;
+            writers[i].lock = &lock;
+            writers[i].id = i;
+            writers[i].n = WORDS / n;
+            if (pthread_create(&writers[i].thread, NULL, write_durably, &writers[i]))
+            {
+                EXIT("pthread_create()");
+            }
+        }
+        for (i = 0; i < n; ++i)
+        {
+            pthread_join(writers[i].thread, NULL);
+            if (writers[i].failed)
+            {
+                printf("error: durable insert failed\n");
+            }
+        }
+        t = now() - t;
+        printf("  %2d threads : %9.0f inserts/s\n",
+               n,
+               (double)(WORDS / n * n) * 1e9 / (double)t);
+        avl_close(store);
+        scratch_delete(pathname);
+    }
+    pthread_mutex_destroy(&lock);
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Takes a snapshot of a scratch store of WORDS words while WORDS more are
+ * inserted, then reports the pause seen by the caller, the copy time, the
+ * pages the inserts had to copy themselves and whether the snapshot holds
+ * exactly the words present when it was taken.
+ */
+
+static int
+snapshot(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    char copy[] = "/tmp/scm-bench-XXXXXX";
+    struct scm_snapshot stats;
+    struct avl *store;
+    char word[32];
+    uint64_t t, items;
+    int i, failed;
+
+    UNUSED(avl);
+
+    printf("\n-- bench snapshot (%d words) -- \n", WORDS);
+    if (scratch(pathname) || scratch(copy))
+    {
+        TRACE(0);
+        return 0;
+    }
+    if (!(store = avl_open(pathname, 1, NULL)))
+    {
+        TRACE(0);
+        scratch_delete(pathname);
+        file_delete(copy);
+        return 0;
+    }
+    failed = 0;
+    for (i = 0; i < WORDS; ++i)
+    {
+        safe_sprintf(word, sizeof(word), "s%x", (unsigned)(i * 2654435761u));
+        failed |= avl_insert(store, word);
+    }
+    items = avl_items(store);
+    if (failed || avl_snapshot(store, copy, &stats))
+    {
+        printf("error: unable to snapshot\n");
+        avl_close(store);
+        scratch_delete(pathname);
+        file_delete(copy);
+        return 0;
+    }
+    t = now();
+    for (i = WORDS; i < 2 * WORDS; ++i)
+    {
+        safe_sprintf(word, sizeof(word), "s%x", (unsigned)(i * 2654435761u));
+        failed |= avl_insert(store, word);
+    }
+    t = now() - t;
+    failed |= avl_snapshot_wait(store, &stats);
+    avl_close(store);
+    printf("  method     : %s\n", stats.cloned ? "reflink" : "copy-before-write");
+    printf("  pause      : %9.3f ms\n", stats.pause * 1e3);
+    printf("  copy       : %9.3f ms\n", stats.elapsed * 1e3);
+    printf("  bytes      : %9lu of %lu\n",
+           (unsigned long)stats.bytes,
+           (unsigned long)stats.size);
+    printf("  early      : %9lu pages\n", (unsigned long)stats.early);
+    printf("  inserts    : %9.0f /s during the copy\n",
+           (double)WORDS * 1e9 / (double)(t ? t : 1));
+    if (failed || !(store = avl_open(copy, 0, NULL)))
+    {
+        printf("error: snapshot failed\n");
+    }
+    else
+    {
+        printf("  snapshot   : %9lu items (%s)\n",
+               (unsigned long)avl_items(store),
+               (items == avl_items(store)) ? "consistent" : "INCONSISTENT");
+        avl_close(store);
+    }
+    scratch_delete(pathname);
+    file_delete(copy);
+    printf("\n");
+    return 0;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+    uint64_t x, y;
+
+    x = *(const uint64_t *)a;
+    y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Builds a scratch store of 8 * WORDS words, laid out breadth first so
+ * that the upper levels of the tree, which every lookup crosses, take the
+ * first eighth of it. Then times random lookups one by one through the
+ * page cache (SCM_BACKEND_MMAP) and through a buffer pool of a quarter of
+ * the store (SCM_BACKEND_BUFFER): the upper levels, and as much again for
+ * the rest. The pool is timed twice, with a working set of HOT words,
+ * whose paths fit, and with all of them, whose lower levels do not. For
+ * each run, reports the latency percentiles and what the pool read and
+ * evicted.
+ */
+
+static int
+pool(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    const struct
+    {
+        const char *name;
+        enum scm_backend backend;
+        int words;
+    } RUNS[] = {
+        {"mmap", SCM_BACKEND_MMAP, 8 * WORDS},
+        {"buffer", SCM_BACKEND_BUFFER, HOT},
+        {"buffer", SCM_BACKEND_BUFFER, 8 * WORDS}};
+    struct scm_options options;
+    struct scm_pool stats;
+    struct avl *store;
+    uint64_t *latency, t, seed;
+    char word[32];
+    int i, r, misses;
+
+    UNUSED(avl);
+
+    printf("\n-- bench pool (%d words, %d lookups) -- \n", 8 * WORDS, PROBES);
+    if (!(latency = malloc(PROBES * sizeof(uint64_t))) || scratch(pathname))
+    {
+        TRACE(0);
+        free(latency);
+        return 0;
+    }
+    memset(&options, 0, sizeof(options));
+    if (!(store = avl_open(pathname, 1, &options)))
+    {
+        TRACE(0);
+        scratch_delete(pathname);
+        free(latency);
+        return 0;
+    }
+    for (i = 0; i < 8 * WORDS; ++i)
+    {
+        safe_sprintf(word, sizeof(word), "p%x", (unsigned)(i * 2654435761u));
+        avl_insert(store, word);
+    }
+    if (avl_compact(store, AVL_LAYOUT_BFS))
+    {
+        TRACE(0);
+    }
+    options.pool = avl_scm_utilized(store) / 4;
+    avl_close(store);
+    for (r = 0; r < (int)ARRAY_SIZE(RUNS); ++r)
+    {
+        options.backend = RUNS[r].backend;
+        if (!(store = avl_open(pathname, 0, &options)))
+        {
+            printf("  %-6s %6d words : unable to open\n", RUNS[r].name, RUNS[r].words);
+            continue;
+        }
+        seed = 1;
+        misses = 0;
+        for (i = 0; i < PROBES; ++i)
+        {
+            seed = seed * 6364136223846793005u + 1442695040888963407u;
+            safe_sprintf(word, sizeof(word), "p%x", (unsigned)((seed >> 33) % (unsigned)RUNS[r].words * 2654435761u));
+            t = now();
+            misses += !avl_exists(store, word);
+            latency[i] = now() - t;
+        }
+        qsort(latency, PROBES, sizeof(uint64_t), latency_cmp);
+        printf("  %-6s %6d words : p50 %6.1f us  p99 %6.1f us  p99.9 %7.1f us  max %8.1f us%s\n",
+               RUNS[r].name,
+               RUNS[r].words,
+               latency[PROBES / 2] / 1e3,
+               latency[PROBES / 100 * 99] / 1e3,
+               latency[PROBES / 1000 * 999] / 1e3,
+               latency[PROBES - 1] / 1e3,
+               misses ? "  (words missing)" : "");
+        avl_scm_pool(store, &stats);
+        if (stats.frames)
+        {
+            printf("                        %lu frames (%s), %lu reads, %lu evictions, %lu refaults\n",
+                   (unsigned long)stats.frames,
+                   stats.direct ? "O_DIRECT" : "page cache",
+                   (unsigned long)stats.reads,
+                   (unsigned long)stats.evictions,
+                   (unsigned long)stats.refaults);
+        }
+        avl_close(store);
+    }
+    scratch_delete(pathname);
+    free(latency);
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Inserts WORDS words into a scratch store, each durable before the next
+ * (SCM_ATOMIC_SYNC), persisted by msync() of pages and then by cache-line
+ * write-back, and reports the throughput of each. Without MAP_SYNC the
+ * latter is emulated: same instructions, page cache durability.
+ */
+
+static int
+persist(struct avl *avl)
+{
+    char pathname[] = "/tmp/scm-bench-XXXXXX";
+    const char *NAMES[] = {"msync", "cacheline"};
+    struct scm_options options;
+    struct avl *store;
+    char word[32];
+    uint64_t t;
+    int i, p, failed;
+
+    UNUSED(avl);
+
+    printf("\n-- bench persist (%d durable inserts) -- \n", WORDS);
+    for (p = 0; p < 2; ++p)
+    {
+        memcpy(pathname + sizeof(pathname) - 7, "XXXXXX", 6);
+        memset(&options, 0, sizeof(options));
+        options.atomicity = SCM_ATOMIC_SYNC;
+        options.persist = p ? SCM_PERSIST_CACHELINE : SCM_PERSIST_MSYNC;
+        if (scratch(pathname) || !(store = avl_open(pathname, 1, &options)))
+        {
+            TRACE(0);
+            break;
+        }
+        failed = 0;
+        t = now();
+        for (i = 0; i < WORDS; ++i)
+        {
+            safe_sprintf(word, sizeof(word), "d%x", (unsigned)(i * 2654435761u));
+            failed |= avl_insert(store, word);
+        }
+        t = now() - t;
+        printf("  %-9s : %9.0f inserts/s  %6.2f us/insert%s%s\n",
+               NAMES[p],
+               (double)WORDS * 1e9 / (double)t,
+               (double)t / WORDS / 1e3,
+               p ? (avl_scm_dax(store) ? "  (MAP_SYNC)" : "  (emulated)") : "",
+               failed ? "  (insert failed)" : "");
+        avl_close(store);
+        scratch_delete(pathname);
+    }
+    printf("\n");
+    return 0;
+}
+
+int bench(struct avl *avl, const char *s)
+{
+    const struct
+    {
+        const char *face;
+        int (*fnc)(struct avl *avl);
+    } BENCHES[] = {
+        {"lookup", lookup},
+        {"threads", threads},
+        {"update", update},
+        {"restart", restart},
+        {"huge", huge},
+        {"calloc", cleared},
+        {"align", align},
+        {"compact", compacted},
+        {"arena", arena},
+        {"wal", wal},
+        {"snapshot", snapshot},
+        {"pool", pool},
+        {"persist", persist}};
+    uint64_t i;
+
+    for (i = 0; i < ARRAY_SIZE(BENCHES); ++i)
+    {
+        if (!strcmp(BENCHES[i].face, s))
+        {
+            return BENCHES[i].fnc(avl);
+        }
+    }
+    printf("error: unknown benchmark '%s', try:", s);
+    for (i = 0; i < ARRAY_SIZE(BENCHES); ++i)
+    {
+        printf(" %s", BENCHES[i].face);
+    }
+    printf("\n");
+    return 0;
+}
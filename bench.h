@@ -0,0 +1,27 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * bench.h
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "avl.h"
+
+/**
+ * Runs the micro-benchmark named in s against an open store and prints
+ * its report. Unknown names list the available benchmarks.
+ *
+ * avl: an open store, its content is not modified
+ * s  : the benchmark name
+ *
+ * return: 0, so that it can serve as a shell command
+ */
+
+int bench(struct avl *avl, const char *s);
+
+#endif /* _BENCH_H_ */
@@ -8,6 +8,7 @@
  */
 
 #include "avl.h"
+#include "bench.h"
 #include "term.h"
 #include "shell.h"
 
@@ -93,18 +94,176 @@ list(struct avl *avl, const char *s)
 static int
 info(struct avl *avl, const char *s)
 {
+    struct scm_stats stats;
+    struct scm_pool pool;
+    size_t c, live;
+
     UNUSED(s);
 
+    avl_scm_stats(avl, &stats);
+    for (live = c = 0; c < SCM_CLASSES; ++c)
+    {
+        live += stats.bytes[c];
+    }
     printf("\n-- info -- \n"
            "  words    : %lu (total)\n"
            "  words    : %lu (unique)\n"
            "  utilized : %lu bytes\n"
            "  capacity : %lu bytes\n"
-           "\n",
+           "  free     : %lu bytes in %lu blocks\n"
+           "  largest  : %lu bytes (free block)\n"
+           "  disk     : %lu bytes\n",
            (unsigned long)avl_items(avl),
            (unsigned long)avl_unique(avl),
            (unsigned long)avl_scm_utilized(avl),
-           (unsigned long)avl_scm_capacity(avl));
+           (unsigned long)avl_scm_capacity(avl),
+           (unsigned long)avl_scm_free_bytes(avl),
+           (unsigned long)avl_scm_free_blocks(avl),
+           (unsigned long)avl_scm_largest_free(avl),
+           (unsigned long)avl_scm_footprint(avl));
+    avl_scm_pool(avl, &pool);
+    if (pool.frames)
+    {
+        printf("  pool     : %lu of %lu frames (%lu pinned), %s\n"
+               "  paging   : %lu reads, %lu writes, %lu evictions, %lu refaults\n",
+               (unsigned long)pool.resident,
+               (unsigned long)pool.frames,
+               (unsigned long)pool.pinned,
+               pool.direct ? "O_DIRECT" : "page cache",
+               (unsigned long)pool.reads,
+               (unsigned long)pool.writes,
+               (unsigned long)pool.evictions,
+               (unsigned long)pool.refaults);
+    }
+    if (avl_scm_dax(avl))
+    {
+        printf("  persist  : cache lines, MAP_SYNC\n");
+    }
+    printf("  allocs   : %lu (%lu freed)\n"
+           "  live     : %lu bytes (payload)\n",
+           (unsigned long)stats.allocs,
+           (unsigned long)stats.frees,
+           (unsigned long)live);
+    for (c = 0; c < SCM_CLASSES; ++c)
+    {
+        if (stats.bytes[c])
+        {
+            if (c + 1 < SCM_CLASSES)
+            {
+                printf("    %3lu B  : %lu bytes\n", (unsigned long)(c + 1) * 8, (unsigned long)stats.bytes[c]);
+            }
+            else
+            {
+                printf("    larger : %lu bytes\n", (unsigned long)stats.bytes[c]);
+            }
+        }
+    }
+    printf("\n");
+    return 0;
+}
+
+static int
+checkpoint(struct avl *avl, const char *s)
+{
+    struct scm_checkpoint stats;
+
+    UNUSED(s);
+
+    if (avl_checkpoint(avl, &stats))
+    {
+        printf("error: checkpoint failed\n");
+    }
+    printf("\n-- checkpoint -- \n"
+           "  pages    : %lu (in %lu runs)\n"
+           "  collect  : %.3f ms\n"
+           "  sync     : %.3f ms\n"
+           "\n",
+           (unsigned long)stats.pages,
+           (unsigned long)stats.runs,
+           stats.collect * 1e3,
+           stats.sync * 1e3);
+    return 0;
+}
+
+static int
+punch(struct avl *avl, const char *s)
+{
+    size_t bytes;
+
+    UNUSED(s);
+
+    bytes = avl_scm_punch(avl);
+    printf("%lu bytes released, %lu bytes on disk\n",
+           (unsigned long)bytes,
+           (unsigned long)avl_scm_footprint(avl));
+    return 0;
+}
+
+static int
+compact(struct avl *avl, const char *s)
+{
+    size_t utilized, disk;
+
+    if (strcmp(s, "inorder") && strcmp(s, "bfs"))
+    {
+        printf("error: layout must be 'inorder' or 'bfs'\n");
+        return 0;
+    }
+    utilized = avl_scm_utilized(avl);
+    disk = avl_scm_footprint(avl);
+    if (avl_compact(avl, strcmp(s, "bfs") ? AVL_LAYOUT_INORDER : AVL_LAYOUT_BFS))
+    {
+        printf("error: compaction failed\n");
+        return 0;
+    }
+    printf("utilized %lu -> %lu bytes, disk %lu -> %lu bytes\n",
+           (unsigned long)utilized,
+           (unsigned long)avl_scm_utilized(avl),
+           (unsigned long)disk,
+           (unsigned long)avl_scm_footprint(avl));
+    return 0;
+}
+
+static int
+snapshot(struct avl *avl, const char *s)
+{
+    struct scm_snapshot stats;
+
+    if (avl_snapshot(avl, s, &stats))
+    {
+        printf("error: unable to snapshot to '%s'\n", s);
+        return 0;
+    }
+    printf("%s, %.3f ms pause\n",
+           stats.cloned ? "reflinked" : "copying",
+           stats.pause * 1e3);
+    if (avl_snapshot_wait(avl, &stats))
+    {
+        printf("error: snapshot '%s' incomplete\n", s);
+        return 0;
+    }
+    printf("%lu of %lu bytes copied in %.3f ms\n",
+           (unsigned long)stats.bytes,
+           (unsigned long)stats.size,
+           stats.elapsed * 1e3);
+    return 0;
+}
+
+static int
+export(struct avl *avl, const char *s)
+{
+    struct scm_export stats;
+
+    if (avl_export(avl, s, &stats))
+    {
+        printf("error: unable to export to '%s'\n", s);
+        return 0;
+    }
+    printf("%lu of %lu bytes written (%lu free bytes left out) in %.3f ms\n",
+           (unsigned long)stats.bytes,
+           (unsigned long)stats.size,
+           (unsigned long)stats.free,
+           stats.elapsed * 1e3);
     return 0;
 }
 
@@ -122,7 +281,13 @@ help(struct avl *avl, const char *s)
            "  load pathname : load words from file @ 'pathname'\n"
            "  insert word   : insert 'word'\n"
            "  exists word   : check if 'word' exists\n"
-           "  delete word   : delete 'word'\n\n");
+           "  delete word   : delete 'word'\n");
+    printf("  checkpoint    : write back the pages modified since the last one\n"
+           "  punch         : give the free pages back to the file system\n"
+           "  compact order : relocate the tree in 'inorder' or 'bfs' order\n"
+           "  snapshot path : write a point-in-time copy of the SCM file to 'path'\n"
+           "  export path   : write only the utilized part of the SCM file to 'path'\n"
+           "  bench name    : run benchmark 'name' (lookup, threads, update, restart, huge, calloc, align, compact, arena, wal, snapshot, pool, persist)\n\n");
     return 0;
 }
 
@@ -152,7 +317,13 @@ shell_fnc(void *arg, const char *s)
         {1, "load", load},
         {1, "insert", insert},
         {1, "exists", exists},
-        {1, "delete", delete}};
+        {1, "delete", delete},
+        {0, "checkpoint", checkpoint},
+        {0, "punch", punch},
+        {1, "compact", compact},
+        {1, "snapshot", snapshot},
+        {1, "export", export},
+        {1, "bench", bench}};
     struct avl *avl;
     uint64_t i;
 
@@ -202,18 +373,41 @@ usage(const char *name)
     printf("usage: %s [options] pathname\n\n"
            "  options:\n"
            "    --truncate : clear SCM content\n"
-           "    --nocolor  : do not use terminal colors\n"
-           "\n",
+           "    --fit      : with --truncate, use the coalescing best-fit allocator\n"
+           "    --chunk    : grow the SCM file in 16 MiB steps instead of doubling\n"
+           "    --nogrow   : fail allocations once the SCM file is full\n"
+           "    --sync     : make every insert/delete durable before returning\n"
+           "    --nolog    : do not make inserts/deletes crash atomic\n"
+           "    --wal      : log inserts/deletes to a side file, replayed at open\n",
            name);
+    printf("    --dax      : persist by cache lines, with MAP_SYNC where available\n"
+           "    --restore f: first restore the SCM file from the export 'f', not with --truncate\n"
+           "    --pool n   : page the SCM file through a buffer pool of n MiB\n"
+           "    --populate : map the whole SCM file at open\n"
+           "    --willneed : read the SCM file ahead at open\n"
+           "    --prefix   : map only the utilized part of the SCM file at open\n"
+           "    --random   : advise random access, no readahead\n"
+           "    --sequential: advise sequential access\n");
+    printf("    --align n  : start every SCM block at a multiple of n bytes\n"
+           "    --huge     : map the SCM file with huge pages\n"
+           "    --flusher  : checkpoint in the background every 100 ms\n"
+           "    --wprotect : track dirty pages with write faults\n"
+           "    --softdirty: track dirty pages with the kernel soft-dirty bits\n"
+           "    --nocolor  : do not use terminal colors\n"
+           "\n");
 }
 
 int main(int argc, char *argv[])
 {
+    struct scm_options options;
     char *pathname = NULL;
+    char *restore = NULL;
     int truncate = 0;
     int nocolor = 0;
     struct avl *avl;
     int i;
+
+    memset(&options, 0, sizeof(options));
     /* parse commandline args*/
     for (i = 1; i < argc; ++i)
     {
@@ -221,6 +415,83 @@ int main(int argc, char *argv[])
         {
             truncate = 1;
         }
+        else if (!strcmp(argv[i], "--fit"))
+        {
+            options.allocator = SCM_ALLOC_FIT;
+        }
+        else if (!strcmp(argv[i], "--chunk"))
+        {
+            options.growth = SCM_GROW_CHUNK;
+        }
+        else if (!strcmp(argv[i], "--nogrow"))
+        {
+            options.growth = SCM_GROW_NONE;
+        }
+        else if (!strcmp(argv[i], "--sync"))
+        {
+            options.atomicity = SCM_ATOMIC_SYNC;
+        }
+        else if (!strcmp(argv[i], "--nolog"))
+        {
+            options.atomicity = SCM_ATOMIC_NONE;
+        }
+        else if (!strcmp(argv[i], "--wal"))
+        {
+            options.wal = 1;
+        }
+        else if (!strcmp(argv[i], "--dax"))
+        {
+            options.persist = SCM_PERSIST_CACHELINE;
+        }
+        else if (!strcmp(argv[i], "--restore") && (i + 1 < argc))
+        {
+            restore = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--pool") && (i + 1 < argc))
+        {
+            options.backend = SCM_BACKEND_BUFFER;
+            options.pool = (size_t)strtoul(argv[++i], NULL, 10) << 20;
+        }
+        else if (!strcmp(argv[i], "--populate"))
+        {
+            options.prefault = SCM_PREFAULT_POPULATE;
+        }
+        else if (!strcmp(argv[i], "--willneed"))
+        {
+            options.prefault = SCM_PREFAULT_WILLNEED;
+        }
+        else if (!strcmp(argv[i], "--prefix"))
+        {
+            options.prefault = SCM_PREFAULT_UTILIZED;
+        }
+        else if (!strcmp(argv[i], "--random"))
+        {
+            options.access = SCM_ACCESS_RANDOM;
+        }
+        else if (!strcmp(argv[i], "--sequential"))
+        {
+            options.access = SCM_ACCESS_SEQUENTIAL;
+        }
+        else if (!strcmp(argv[i], "--align") && (i + 1 < argc))
+        {
+            options.alignment = (size_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--huge"))
+        {
+            options.pages = SCM_PAGES_HUGE;
+        }
+        else if (!strcmp(argv[i], "--flusher"))
+        {
+            options.flush_ms = 100;
+        }
+        else if (!strcmp(argv[i], "--wprotect"))
+        {
+            options.tracking = SCM_TRACK_WPROTECT;
+        }
+        else if (!strcmp(argv[i], "--softdirty"))
+        {
+            options.tracking = SCM_TRACK_SOFTDIRTY;
+        }
         else if (!strcmp(argv[i], "--nocolor") && !nocolor)
         {
             nocolor = 1;
@@ -245,8 +516,19 @@ int main(int argc, char *argv[])
         usage(argv[0]);
         return -1;
     }
+    if (restore && truncate)
+    {
+        /* the restore replaces the content, there is nothing to clear */
+        printf("error: --restore and --truncate cannot be combined\n");
+        return -1;
+    }
+    if (restore && avl_import(restore, pathname, 0, NULL))
+    {
+        printf("error: unable to restore '%s' from '%s'\n", pathname, restore);
+        return -1;
+    }
     /* open avl */
-    if (!(avl = avl_open(pathname, truncate)))
+    if (!(avl = avl_open(pathname, truncate, &options)))
     {
         TRACE(0);
         return -1;
@@ -12,8 +12,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <semaphore.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include "scm.h"
 
 /**
@@ -24,266 +37,5387 @@
  *   close()
  *   sbrk()
  *   mmap()
+ *   mremap()
  *   munmap()
  *   msync()
+ *   mprotect()
+ *   madvise()
+ *   fstatfs()
+ *   fallocate()
+ *   sigaction()
+ *   pread()
+ *   writev()
+ *   fdatasync()
+ *   ftruncate()
+ *   pwrite()
+ *   ioctl()
+ *   lseek()
+ *   flock()
+ *   pthread_mutex_lock()
+ *   pthread_getspecific()
+ *   pthread_create()
+ *   pthread_cond_wait()
+ *   sem_timedwait()
  */
 
 /* research the above Needed API and design accordingly */
-#define VIRT_ADDR 0x600000000000 /* the base address of the heap */
+#define RESERVE ((size_t)1 << 40) /* default address space kept for growth */
+#define CHUNK ((size_t)16 << 20)  /* default SCM_GROW_CHUNK step */
+#define REGIONS 64                /* regions open at once in one process */
+#define HUGE ((size_t)2 << 20)    /* SCM_PAGES_HUGE alignment, a PMD mapping */
+
+/**
+ * Every change to struct header or to the block and slab layouts bumps
+ * VERSION, and scm_open() refuses a region of any other version rather
+ * than read it. Regions written before the superblock existed start with
+ * their utilized count, or with the FORMAT word that stood in for VERSION,
+ * instead of MAGIC and are refused as well: there is no converting them,
+ * only truncating.
+ */
+
+#define MAGIC ((size_t)0x314e4f4947455253) /* "SREGION1", a formatted region */
+#define VERSION 3      /* of struct header and the block layouts */
+
+#define GRANULE 8      /* block payloads are rounded up to this many bytes */
+#define CLASSES (SCM_CLASSES - 1) /* exact-size free lists: 8, 16, ..., 256 bytes */
+#define LARGE CLASSES  /* index of the first-fit list for bigger blocks */
+#define CACHE 64       /* blocks a thread caches per class before flushing */
+#define SPAN ((size_t)64 << 10) /* tail bytes a thread reserves at a time */
+
+#define FIT_ALLOC 1    /* boundary tag bit: this block is in use */
+#define FIT_PREV 2     /* boundary tag bit: the preceding block is in use */
+#define FIT_PUNCHED 4  /* boundary tag bit: whole pages inside were punched */
+#define FIT_FLAGS 15   /* sizes are multiples of 16, low bits hold flags */
+#define FIT_MIN 32     /* tag + next + prev + footer */
+#define PADDED ((size_t)1 << 63) /* word before an aligned payload: distance back to the real one */
+#define BINS 128       /* 2..63 hold exact sizes, 64.. one power of two each */
+#define SLAB 4096      /* bytes of a slab, at a multiple of its size */
+#define SLAB_MIN 16    /* smallest slab object, see struct slab */
+#define SLAB_MAX 512   /* largest slab object */
+#define SLAB_HEAD 64   /* size word and struct slab, before the first slot */
+#define POOLS 8        /* object sizes with slabs in one region */
+#define ARENA ((size_t)64 << 10) /* default size of an arena's first chunk */
+#define CHUNKS 48      /* chunks of one arena, each twice the one before */
+#define COPY ((size_t)1 << 20) /* bytes read at a time by scm_import() */
+#define POOL ((size_t)64 << 20) /* default SCM_BACKEND_BUFFER pool */
+#define POOL_FREE 64   /* frames of a pool that cannot be pinned */
+#define LINE 64        /* cache line, the granule of SCM_PERSIST_CACHELINE */
+
+#define LOG_WORDS 4096 /* undo log capacity, 32 KiB of the region header */
+#define PENDING 256    /* ranges remembered for flushing at commit */
+
+/**
+ * The persistent region header, stored at offset 0 of the backing file.
+ * It opens with a superblock that scm_open() checks in O(1) before
+ * trusting anything else: a magic number, the layout version, the page
+ * size and allocator it was formatted with, the offset of the root block,
+ * the last write-ahead log record applied and the allocator statistics
+ * as of the last checkpoint.
+ *
+ * Free lists are singly linked through the first word of each free
+ * payload and hold offsets from base (0 terminates a list), so that a
+ * recycled block costs one load and one store to pop or push.
+ *
+ * In SCM_ALLOC_FIT mode, blocks instead carry a boundary tag (total size
+ * plus FIT_* bits) and free blocks repeat their size in a trailing footer,
+ * so both neighbours of a freed block are found in O(1) and merged. Free
+ * blocks are doubly linked into size-ordered bins with a bitmap of the
+ * non-empty ones; taking the first block of the first bin that fits gives
+ * a best fit.
+ *
+ * Objects of a fixed size may instead come from slabs, see struct slab,
+ * one pool of them per size: partial links the slabs with a free slot.
+ *
+ * A compaction copies the live blocks past the end of the data area and
+ * then moves them down to its start, see scm_compact_begin(). compact,
+ * moving and moved record how far it got, for scm_open() to finish or
+ * drop it; fresh is the slab a pool fills meanwhile, its partial list
+ * after.
+ *
+ * Between scm_begin() and scm_commit() every region byte about to be
+ * overwritten, allocator metadata included, is first saved in the log; a
+ * non-empty log found by scm_open() means a transaction never committed,
+ * and it is rolled back.
+ */
+
+struct header
+{
+    size_t magic;             /* MAGIC */
+    size_t version;           /* VERSION */
+    size_t page;              /* page size when formatted, see huge_page() */
+    size_t mode;              /* enum scm_allocator fixed at truncation */
+    size_t root;              /* offset of scm_mbase() */
+    size_t lsn;               /* last log record applied, see scm_wal_append() */
+    struct scm_stats stats;   /* as of the last checkpoint, see tally() */
+    size_t utilized;          /* bump offset past the end of the data area */
+    size_t freed;             /* bytes (headers included) on the free lists */
+    size_t blocks;            /* number of blocks on the free lists */
+    size_t free[CLASSES + 1]; /* per-class list heads, [LARGE] is first-fit */
+    size_t bins[BINS];        /* SCM_ALLOC_FIT list heads, ascending sizes */
+    size_t map[BINS / 64];    /* SCM_ALLOC_FIT non-empty bins */
+    struct
+    {
+        size_t size;    /* bytes per object, 0 for an unused pool */
+        size_t partial; /* slabs with a free slot, linked via next */
+        size_t fresh;   /* slab filled by a compaction, or 0 */
+    } pools[POOLS];
+    size_t compact;           /* offset of the compaction copy, or 0 */
+    size_t moving;            /* its length once it is complete, or 0 */
+    size_t moved;             /* bytes of it moved down so far, see relocate() */
+    size_t used;              /* words of valid entries in log */
+    size_t log[LOG_WORDS];    /* undo entries, see undo() */
+};
+
+/**
+ * The head of a slab: an ordinary block of SLAB bytes, size word included,
+ * at a SLAB-aligned offset, so that slabs carved one after the other are
+ * contiguous. It holds objects of one size without a size word each, from
+ * SLAB_HEAD on. The slab of an object is found by rounding its offset
+ * down, the slot by dividing. Empty slabs stay in their pool.
+ */
+
+struct slab
+{
+    size_t size;                         /* bytes per object */
+    size_t used;                         /* slots in use */
+    size_t next;                         /* the pool's partial list, or 0 */
+    uint64_t map[SLAB / SLAB_MIN / 64];  /* one bit per slot in use */
+};
+
+/**
+ * A thread's private allocation state for one SCM_ALLOC_CLASS region.
+ * Freed blocks are stacked per class without locking (still linked by
+ * offset through their payload) and small blocks are carved from a span
+ * reserved off the tail in one atomic step. The stacks overflow to, and
+ * refill from, the persistent lists in batches under scm->lock. Whatever
+ * a cache holds when the process dies is lost to the region.
+ */
+
+struct cache
+{
+    struct scm *scm;
+    struct cache *prev, *next; /* caches of the same region */
+    size_t head[CLASSES];      /* cached free blocks, linked via block[1] */
+    size_t count[CLASSES];
+    size_t cur, end;           /* unused offsets of the thread's span */
+    size_t fresh;              /* offsets of the span from here on are zero */
+    struct scm_stats stats;    /* this thread's allocations since scm_open() */
+};
+
+/**
+ * A scratch allocator on top of scm_malloc(), private to the process and
+ * to one thread. Objects are bumped out of chunks with no per-object
+ * bookkeeping; the chunks double in size so that there are few of them,
+ * and a reset only rewinds to the first one. Nothing about an arena is
+ * in the region but its chunks, which are plain blocks.
+ */
+
+struct scm_arena
+{
+    struct scm *scm;
+    size_t chunk;          /* size of the first chunk */
+    size_t align;          /* of every object */
+    size_t count;          /* chunks allocated */
+    size_t cur;            /* the chunk being filled */
+    size_t pos;            /* bytes of it used */
+    char *base[CHUNKS];
+    size_t size[CHUNKS];
+};
 
 struct scm
 {
-    int fd;
-    size_t size;
-    size_t utilized;
-    void *base; /* root address */
-};
+    int fd;
+    size_t size;    /* bytes of the backing file mapped at base */
+    size_t reserve; /* bytes of address space reserved at base */
+    size_t page;    /* granule of msync() and dirty tracking, see huge_page() */
+    int dax;        /* mapped with MAP_SYNC, see lines() */
+    size_t align;   /* granule of the base address and of the file size */
+    size_t *dirty;  /* one bit per reserved page modified since its flush */
+    size_t dirtied; /* bits set in dirty */
+    size_t zero;    /* the file holds only zeros from this offset on */
+    void *base; /* root address */
+    struct header *header;
+    struct scm_options options;
+    int slot; /* index in the registry, -1 when not registered */
+    int ready; /* the locks and key below are initialized */
+    pthread_mutex_t lock;    /* shared free lists, SCM_ALLOC_FIT heap */
+    pthread_mutex_t growing; /* grow() */
+    pthread_key_t key;       /* the calling thread's struct cache */
+    struct cache *caches;    /* every thread cache of this region */
+    pthread_t flusher;       /* background checkpoints, see flusher() */
+    int flushing;            /* the flusher thread is running */
+    int stop;                /* asks the flusher thread to exit */
+    sem_t wake;              /* posted to run a checkpoint early */
+    pthread_mutex_t barrier; /* started, completed and failed */
+    pthread_cond_t flushed;  /* completed was advanced */
+    size_t started;          /* checkpoints begun by the flusher */
+    size_t completed;        /* the last of them that is over */
+    int failed;              /* it did not write everything back */
+    int compacting;          /* between scm_compact_begin() and its end */
+    struct scm_stats opened; /* header->stats at scm_open() */
+    struct scm_stats stats;  /* since then: locked paths, threads gone */
+    struct scm_stats copied; /* allocations of the open compaction */
+    int wal[2];              /* write-ahead log files, -1 without, see wal_open() */
+    int cur;                 /* the one appended to */
+    size_t last[2];          /* last record in each, 0 while empty */
+    int unsynced[2];         /* written since its last fdatasync() */
+    size_t next;             /* sequence number of the next record */
+    size_t applied;          /* last record whose transaction is over */
+    size_t synced;           /* records durable up to this one */
+    int syncing;             /* an fdatasync() is under way */
+    size_t replay;           /* the record being replayed, or 0 */
+    size_t appended;         /* the record of the open transaction, or 0 */
+    pthread_mutex_t logging; /* the log fields above */
+    pthread_cond_t logged;   /* synced was advanced */
+    int snapping;            /* a snapshot is being copied, see scm_snapshot() */
+    size_t faulting;         /* fault() calls looking at snap */
+    struct
+    {
+        int fd;              /* the copy */
+        size_t size;         /* bytes of the region it holds */
+        size_t *claimed;     /* one bit per page being or already copied */
+        size_t *done;        /* one bit per page copied */
+        pthread_t thread;    /* copies the pages no write got to first */
+        int running;         /* thread is to be joined */
+        int failed;          /* a page could not be written */
+        double start;
+        struct scm_snapshot stats;
+    } snap;
+    struct
+    {
+        int on;              /* SCM_BACKEND_BUFFER, see pool_fault() */
+        int fd;              /* the backing file opened O_DIRECT, or fd */
+        char busy;           /* spin lock of the fields below */
+        size_t head;         /* pages of the header, always pinned */
+        size_t used;         /* slots of clock filled so far */
+        size_t hand;         /* the slot the clock looks at next */
+        size_t *clock;       /* page held by each slot, or a stale one */
+        size_t *resident;    /* one bit per page with a frame */
+        size_t *referenced;  /* one bit per page accessible */
+        size_t *written;     /* one bit per page writable, modified since read */
+        size_t *pinned;      /* one bit per page never evicted */
+        struct scm_pool stats;
+    } pool;
+    int tx;                  /* a transaction is open */
+    struct cache saved;      /* the transaction thread's cache at scm_begin() */
+    size_t pending;          /* entries used in range */
+    struct range
+    {
+        size_t offset;
+        size_t length;
+        int logged; /* an undo entry covers it */
+    } range[PENDING];        /* what the open transaction touched */
+};
+
+/**
+ * The process-wide registry of open regions. Each region owns a private
+ * reserved address range (its slot), so any number of backing files can
+ * be mapped side by side without overlapping. Unused slot indices are
+ * kept on a stack, making registration O(1) however many are open.
+ *
+ * Opening and closing threads take registering. Lookups do not: fault()
+ * runs in a signal handler and cannot lock, so a region is published into
+ * slot with a release store once its range is reserved, read back with
+ * acquire loads, and withdrawn before the range is unmapped.
+ */
+
+static struct
+{
+    struct scm *slot[REGIONS];
+    int unused[REGIONS];
+    int n; /* unused slot indices on the stack */
+    int ready;
+} registry;
+
+static pthread_mutex_t registering = PTHREAD_MUTEX_INITIALIZER;
+
+static int registry_claim(struct scm *scm)
+{
+    int i;
+
+    pthread_mutex_lock(&registering);
+    if (!registry.ready)
+    {
+        for (i = 0; i < REGIONS; ++i)
+        {
+            registry.unused[i] = REGIONS - 1 - i;
+        }
+        registry.n = REGIONS;
+        registry.ready = 1;
+    }
+    if (!registry.n)
+    {
+        pthread_mutex_unlock(&registering);
+        return -1;
+    }
+    scm->slot = registry.unused[--registry.n];
+    pthread_mutex_unlock(&registering);
+    return 0;
+}
+
+/* makes scm visible to scm_region(), once base and reserve are final */
+
+static void registry_publish(struct scm *scm)
+{
+    __atomic_store_n(&registry.slot[scm->slot], scm, __ATOMIC_RELEASE);
+}
+
+static void registry_release(struct scm *scm)
+{
+    if (0 <= scm->slot)
+    {
+        __atomic_store_n(&registry.slot[scm->slot], NULL, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&registering);
+        registry.unused[registry.n++] = scm->slot;
+        pthread_mutex_unlock(&registering);
+        scm->slot = -1;
+    }
+}
+
+/* undoes a (partial) scm_open(), without syncing anything */
+
+static void release(struct scm *scm)
+{
+    struct cache *cache;
+
+    /* no fault may find the region once its range is gone */
+    registry_release(scm);
+    if (scm->ready)
+    {
+        while ((cache = scm->caches))
+        {
+            scm->caches = cache->next;
+            free(cache);
+        }
+        pthread_key_delete(scm->key);
+        sem_destroy(&scm->wake);
+        pthread_cond_destroy(&scm->flushed);
+        pthread_cond_destroy(&scm->logged);
+        pthread_mutex_destroy(&scm->logging);
+        pthread_mutex_destroy(&scm->barrier);
+        pthread_mutex_destroy(&scm->growing);
+        pthread_mutex_destroy(&scm->lock);
+    }
+    if (scm->base && (MAP_FAILED != scm->base))
+    {
+        if (munmap(scm->base, scm->reserve) == -1)
+        {
+            TRACE("munmap error");
+        }
+    }
+    if (0 <= scm->fd)
+    {
+        close(scm->fd);
+    }
+    if (0 <= scm->wal[0])
+    {
+        close(scm->wal[0]);
+    }
+    if (0 <= scm->wal[1])
+    {
+        close(scm->wal[1]);
+    }
+    if (scm->pool.on)
+    {
+        if (scm->pool.fd != scm->fd)
+        {
+            close(scm->pool.fd);
+        }
+        free(scm->pool.clock);
+        free(scm->pool.resident);
+        free(scm->pool.referenced);
+        free(scm->pool.written);
+        free(scm->pool.pinned);
+    }
+    free(scm->dirty);
+    memset(scm, 0, sizeof(struct scm));
+    free(scm);
+}
+
+static size_t size_class(size_t n)
+{
+    return (n <= CLASSES * GRANULE) ? (n / GRANULE - 1) : LARGE;
+}
+
+static size_t *block_at(const struct scm *scm, size_t offset)
+{
+    return (size_t *)((char *)scm->base + offset);
+}
+
+static size_t offset_of(const struct scm *scm, const void *p)
+{
+    return (size_t)((const char *)p - (const char *)scm->base);
+}
+
+/* adds the counts of b to a */
+
+static void stats_add(struct scm_stats *a, const struct scm_stats *b)
+{
+    size_t c;
+
+    a->allocs += b->allocs;
+    a->frees += b->frees;
+    for (c = 0; c < SCM_CLASSES; ++c)
+    {
+        a->bytes[c] += b->bytes[c];
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        EXIT("clock_gettime()");
+    }
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Marks the pages covering [p, p + n) as modified. Every write path into
+ * the region that scm.c knows of ends up here: the allocator, scm_log()
+ * and recovery. Safe from several threads.
+ */
+
+static void dirty(struct scm *scm, const void *p, size_t n)
+{
+    size_t i, to;
+
+    i = offset_of(scm, p) / scm->page;
+    to = (offset_of(scm, p) + n + scm->page - 1) / scm->page;
+    for (; i < to; ++i)
+    {
+        if (!(__atomic_fetch_or(&scm->dirty[i / 64], (size_t)1 << (i % 64), __ATOMIC_RELAXED) &
+              ((size_t)1 << (i % 64))) &&
+            (scm->options.flush_bytes / scm->page == __atomic_fetch_add(&scm->dirtied, 1, __ATOMIC_RELAXED)) &&
+            scm->options.flush_bytes)
+        {
+            /* async-signal-safe, fault() gets here too */
+            sem_post(&scm->wake);
+        }
+    }
+}
+
+static int bit_test(const size_t *map, size_t i)
+{
+    return 0 != (map[i / 64] & ((size_t)1 << (i % 64)));
+}
+
+static void bit_set(size_t *map, size_t i)
+{
+    map[i / 64] |= (size_t)1 << (i % 64);
+}
+
+static void bit_clear(size_t *map, size_t i)
+{
+    map[i / 64] &= ~((size_t)1 << (i % 64));
+}
+
+/**
+ * SCM_BACKEND_BUFFER: the region is private anonymous memory, and scm.c
+ * moves the pages of the backing file in and out of it, at most
+ * pool.stats.frames at a time. A page is absent, resident but not
+ * referenced since the clock hand passed it, referenced (read-only) or
+ * written (read-write, and dirty), each state with its own protection,
+ * so that any access that needs a transition faults. Transitions happen
+ * under pool.busy, and whoever holds it touches the region only through
+ * system calls, so that it never faults itself.
+ */
+
+static void pool_lock(struct scm *scm)
+{
+    while (__atomic_test_and_set(&scm->pool.busy, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+static void pool_unlock(struct scm *scm)
+{
+    __atomic_clear(&scm->pool.busy, __ATOMIC_RELEASE);
+}
+
+static char *page_at(const struct scm *scm, size_t i)
+{
+    return (char *)scm->base + i * scm->page;
+}
+
+/* writes back resident page i, which stays resident and read-only */
+
+static int pool_writeback(struct scm *scm, size_t i)
+{
+    if (mprotect(page_at(scm, i), scm->page, PROT_READ))
+    {
+        return -1;
+    }
+    bit_set(scm->pool.referenced, i);
+    if ((ssize_t)scm->page != pwrite(scm->pool.fd, page_at(scm, i), scm->page, (off_t)(i * scm->page)))
+    {
+        return -1;
+    }
+    bit_clear(scm->pool.written, i);
+    if (__atomic_fetch_and(&scm->dirty[i / 64], ~((size_t)1 << (i % 64)), __ATOMIC_RELAXED) &
+        ((size_t)1 << (i % 64)))
+    {
+        __atomic_fetch_sub(&scm->dirtied, 1, __ATOMIC_RELAXED);
+    }
+    scm->pool.stats.writes++;
+    return 0;
+}
+
+/* gives up the frame of resident page i, written back or not */
+
+static int pool_drop(struct scm *scm, size_t i)
+{
+    if (MAP_FAILED == mmap(page_at(scm, i),
+                           scm->page,
+                           PROT_NONE,
+                           MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1,
+                           0))
+    {
+        return -1;
+    }
+    bit_clear(scm->pool.resident, i);
+    bit_clear(scm->pool.referenced, i);
+    bit_clear(scm->pool.written, i);
+    scm->pool.stats.resident--;
+    return 0;
+}
+
+/**
+ * Returns a slot of the clock for a page about to be read in, evicting
+ * the first unpinned page the hand finds unreferenced; referenced pages
+ * lose the bit and their access on the way, so that their next use sets
+ * it again. A written page goes back to the file first, after the header
+ * if an open transaction has undo entries in it, so that the file never
+ * holds a change it could not roll back. SIZE_MAX if nothing can go.
+ */
+
+static size_t pool_victim(struct scm *scm)
+{
+    size_t n, slot, i, h, logged;
+
+    if (scm->pool.used < scm->pool.stats.frames)
+    {
+        return scm->pool.used++;
+    }
+    logged = offset_of(scm, &scm->header->used) / scm->page;
+    for (n = 0; n < 2 * scm->pool.stats.frames; ++n)
+    {
+        slot = scm->pool.hand;
+        scm->pool.hand = (slot + 1) % scm->pool.stats.frames;
+        i = scm->pool.clock[slot];
+        if (!bit_test(scm->pool.resident, i))
+        {
+            /* dropped by punch(), or the page moved to another slot */
+            return slot;
+        }
+        if (bit_test(scm->pool.pinned, i))
+        {
+            continue;
+        }
+        if (bit_test(scm->pool.referenced, i))
+        {
+            if (!mprotect(page_at(scm, i), scm->page, PROT_NONE))
+            {
+                bit_clear(scm->pool.referenced, i);
+            }
+            continue;
+        }
+        if (bit_test(scm->pool.written, i))
+        {
+            if (bit_test(scm->pool.resident, logged) && scm->header->used)
+            {
+                for (h = 0; h < scm->pool.head; ++h)
+                {
+                    if (bit_test(scm->pool.written, h) && pool_writeback(scm, h))
+                    {
+                        break;
+                    }
+                }
+                if (h < scm->pool.head)
+                {
+                    continue;
+                }
+            }
+            if (pool_writeback(scm, i))
+            {
+                continue;
+            }
+        }
+        if (!pool_drop(scm, i))
+        {
+            scm->pool.stats.evictions++;
+            return slot;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * Reads page i into a frame: into a staging page first, moved over the
+ * page once complete, so that no other thread can see a partial read.
+ */
+
+static int pool_load(struct scm *scm, size_t i)
+{
+    size_t slot;
+    char *stage;
+
+    if (SIZE_MAX == (slot = pool_victim(scm)))
+    {
+        return -1;
+    }
+    scm->pool.clock[slot] = i;
+    stage = mmap(NULL, scm->page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == stage)
+    {
+        return -1;
+    }
+    /* past the end of a file of odd size, the page reads as zeros */
+    if ((0 > pread(scm->pool.fd, stage, scm->page, (off_t)(i * scm->page))) ||
+        mprotect(stage, scm->page, PROT_READ) ||
+        (MAP_FAILED == mremap(stage, scm->page, scm->page, MREMAP_MAYMOVE | MREMAP_FIXED, page_at(scm, i))))
+    {
+        munmap(stage, scm->page);
+        return -1;
+    }
+    bit_set(scm->pool.resident, i);
+    bit_set(scm->pool.referenced, i);
+    scm->pool.stats.resident++;
+    scm->pool.stats.reads++;
+    return 0;
+}
+
+/**
+ * A fault at offset of an SCM_BACKEND_BUFFER region: reads the page in,
+ * gives it back its access, or lets a clean page be written, whichever
+ * its state calls for. A write to an absent page takes two faults.
+ */
+
+static int pool_fault(struct scm *scm, size_t offset)
+{
+    size_t i;
+    int rc;
+
+    i = offset / scm->page;
+    rc = 0;
+    pool_lock(scm);
+    if (!bit_test(scm->pool.resident, i))
+    {
+        rc = pool_load(scm, i);
+    }
+    else if (!bit_test(scm->pool.referenced, i))
+    {
+        rc = mprotect(page_at(scm, i),
+                      scm->page,
+                      bit_test(scm->pool.written, i) ? (PROT_READ | PROT_WRITE) : PROT_READ);
+        if (!rc)
+        {
+            bit_set(scm->pool.referenced, i);
+            scm->pool.stats.refaults++;
+        }
+    }
+    else if (!bit_test(scm->pool.written, i))
+    {
+        /* as with SCM_TRACK_WPROTECT, writable first, marked next */
+        if (!(rc = mprotect(page_at(scm, i), scm->page, PROT_READ | PROT_WRITE)))
+        {
+            bit_set(scm->pool.written, i);
+            dirty(scm, page_at(scm, i), 1);
+        }
+    }
+    pool_unlock(scm);
+    return rc;
+}
+
+/* flush() of an SCM_BACKEND_BUFFER region: pages [from, to) */
+
+static int pool_write(struct scm *scm, size_t from, size_t to)
+{
+    size_t i;
+    int rc;
+
+    rc = 0;
+    pool_lock(scm);
+    for (i = from; i < to; ++i)
+    {
+        if (bit_test(scm->pool.written, i) && pool_writeback(scm, i))
+        {
+            rc = -1;
+        }
+    }
+    pool_unlock(scm);
+    return (rc || fdatasync(scm->pool.fd)) ? -1 : 0;
+}
+
+/**
+ * SCM_PERSIST_CACHELINE: the cache-line write-back instructions of the
+ * CPU, best first, found once with cpuid. clwb leaves the line cached,
+ * clflushopt evicts it, and both are weakly ordered, hence the fence
+ * after them; clflush is strongly ordered, but slower for it.
+ */
+
+enum
+{
+    LINE_NONE,
+    LINE_CLFLUSH,
+    LINE_CLFLUSHOPT,
+    LINE_CLWB
+};
+
+static int line_op(void)
+{
+    static int op = -1;
+    unsigned a, b, c, d;
+    int found;
+
+    if (0 > (found = __atomic_load_n(&op, __ATOMIC_RELAXED)))
+    {
+        found = LINE_NONE;
+        a = b = c = d = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        if (__get_cpuid(1, &a, &b, &c, &d) && (d & (1u << 19)))
+        {
+            found = LINE_CLFLUSH;
+        }
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        {
+            found = (b & (1u << 23)) ? LINE_CLFLUSHOPT : found;
+            found = (b & (1u << 24)) ? LINE_CLWB : found;
+        }
+#endif
+        UNUSED(a + b + c + d);
+        __atomic_store_n(&op, found, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+/**
+ * Writes back the cache lines covering [p, p + n) and waits for them. On
+ * a MAP_SYNC mapping of persistent memory, that makes them durable with
+ * no system call; on any other file the same instructions run, and the
+ * data is as safe as in the page cache. Encoded by hand for assemblers
+ * that predate them: clwb is xsaveopt with a 66 prefix, clflushopt is
+ * clflush with one.
+ */
+
+static void lines(const void *p, size_t n)
+{
+    volatile char *q, *end;
+
+    q = (volatile char *)((size_t)p / LINE * LINE);
+    end = (volatile char *)p + n;
+#if defined(__x86_64__) || defined(__i386__)
+    switch (line_op())
+    {
+    case LINE_CLWB:
+        for (; q < end; q += LINE)
+        {
+            __asm__ __volatile__(".byte 0x66; xsaveopt %0" : "+m"(*q));
+        }
+        break;
+    case LINE_CLFLUSHOPT:
+        for (; q < end; q += LINE)
+        {
+            __asm__ __volatile__(".byte 0x66; clflush %0" : "+m"(*q));
+        }
+        break;
+    case LINE_CLFLUSH:
+        for (; q < end; q += LINE)
+        {
+            __asm__ __volatile__("clflush %0" : "+m"(*q));
+        }
+        break;
+    default:
+        break;
+    }
+    __asm__ __volatile__("sfence" : : : "memory");
+#else
+    UNUSED(q);
+    UNUSED(end);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/* synchronously writes back the pages covering [p, p + n) */
+
+static int flush(struct scm *scm, const void *p, size_t n)
+{
+    size_t from, to, i;
+
+    from = offset_of(scm, p) / scm->page;
+    to = (offset_of(scm, p) + n + scm->page - 1) / scm->page;
+    for (i = from; i < to; ++i)
+    {
+        if (__atomic_fetch_and(&scm->dirty[i / 64], ~((size_t)1 << (i % 64)), __ATOMIC_RELAXED) &
+            ((size_t)1 << (i % 64)))
+        {
+            __atomic_fetch_sub(&scm->dirtied, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (scm->pool.on)
+    {
+        if (pool_write(scm, from, to))
+        {
+            TRACE("write-back failed");
+            dirty(scm, p, n);
+            return -1;
+        }
+        return 0;
+    }
+    /* clean pages must fault again on their next write, see fault() */
+    if ((SCM_TRACK_WPROTECT == scm->options.tracking) &&
+        mprotect((char *)scm->base + from * scm->page, (to - from) * scm->page, PROT_READ))
+    {
+        TRACE("mprotect() failed");
+        dirty(scm, p, n);
+        return -1;
+    }
+    if (scm->dax)
+    {
+        /* MAP_SYNC: the cache is all there is to write back */
+        lines((char *)scm->base + from * scm->page, (to - from) * scm->page);
+    }
+    else if (msync((char *)scm->base + from * scm->page, (to - from) * scm->page, MS_SYNC))
+    {
+        TRACE("msync error");
+        dirty(scm, p, n);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the n bytes at p durable, for a transaction or scm_persist(): by
+ * their cache lines with SCM_PERSIST_CACHELINE, else by their pages. An
+ * emulated line flush leaves the pages dirty, for a checkpoint to take
+ * them to disk.
+ */
+
+static int persist(struct scm *scm, const void *p, size_t n)
+{
+    if (SCM_PERSIST_CACHELINE != scm->options.persist)
+    {
+        return flush(scm, p, n);
+    }
+    lines(p, n);
+    if (!scm->dax)
+    {
+        dirty(scm, p, n);
+    }
+    return 0;
+}
+
+/* copies page i of the region to the snapshot, see scm_snapshot() */
+
+static int snap_copy(struct scm *scm, size_t i)
+{
+    size_t offset, n;
+
+    offset = i * scm->page;
+    n = (scm->snap.size - offset < scm->page) ? (scm->snap.size - offset) : scm->page;
+    if ((ssize_t)n != pwrite(scm->snap.fd, (char *)scm->base + offset, n, (off_t)offset))
+    {
+        return -1;
+    }
+    __atomic_fetch_add(&scm->snap.stats.bytes, n, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * A write to a page a snapshot has yet to copy: whoever claims the page
+ * first copies it, the writer or the snapshot thread, and the write goes
+ * ahead once the copy is done (until then, it simply faults again).
+ * Returns whether the fault was ours.
+ */
+
+static int snap_fault(struct scm *scm, size_t offset)
+{
+    size_t i, bit;
+    int ours;
+
+    ours = 0;
+    __atomic_fetch_add(&scm->faulting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scm->snapping, __ATOMIC_SEQ_CST) && (offset < scm->snap.size))
+    {
+        i = offset / scm->page;
+        bit = (size_t)1 << (i % 64);
+        if (!(__atomic_fetch_or(&scm->snap.claimed[i / 64], bit, __ATOMIC_ACQ_REL) & bit))
+        {
+            scm->snap.failed |= snap_copy(scm, i);
+            __atomic_fetch_add(&scm->snap.stats.early, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_or(&scm->snap.done[i / 64], bit, __ATOMIC_ACQ_REL);
+        }
+        if ((__atomic_load_n(&scm->snap.done[i / 64], __ATOMIC_ACQUIRE) & bit) &&
+            !mprotect((char *)scm->base + i * scm->page, scm->page, PROT_READ | PROT_WRITE) &&
+            (SCM_TRACK_WPROTECT == scm->options.tracking))
+        {
+            dirty(scm, (char *)scm->base + offset, 1);
+        }
+        ours = 1;
+    }
+    __atomic_fetch_sub(&scm->faulting, 1, __ATOMIC_SEQ_CST);
+    return ours;
+}
+
+/**
+ * SCM_TRACK_WPROTECT: a write to a clean, hence read-only, page of a
+ * region lands here. The page is made writable before it is marked, so
+ * that a checkpoint racing with us either sees the mark or protects the
+ * page again after it. Writes to a page a snapshot is yet to copy also
+ * land here, see snap_fault(), and every fault of an SCM_BACKEND_BUFFER
+ * region, see pool_fault(). Any other fault goes to the previous
+ * handler.
+ */
+
+static struct sigaction chained;
+
+static void fault(int sig, siginfo_t *info, void *context)
+{
+    struct scm *scm;
+    size_t offset;
+    int saved;
+
+    /* the interrupted code may be about to read errno */
+    saved = errno;
+    if ((scm = scm_region(info->si_addr)) &&
+        ((offset = offset_of(scm, info->si_addr)) < __atomic_load_n(&scm->size, __ATOMIC_ACQUIRE)))
+    {
+        if (scm->pool.on ? !pool_fault(scm, offset) : snap_fault(scm, offset))
+        {
+            errno = saved;
+            return;
+        }
+        if ((SCM_TRACK_WPROTECT == scm->options.tracking) &&
+            !mprotect((char *)scm->base + offset / scm->page * scm->page, scm->page, PROT_READ | PROT_WRITE))
+        {
+            dirty(scm, info->si_addr, 1);
+            errno = saved;
+            return;
+        }
+    }
+    /**
+     * Not ours. A previous handler gets the fault as if it were installed,
+     * and we stay installed for the faults of our regions that follow.
+     * Only the default action, which a rerun of the faulting instruction
+     * then takes, needs the handler out of the way; an ignored SIGSEGV
+     * would rerun it forever, so it gets the default action as well.
+     */
+    if (chained.sa_flags & SA_SIGINFO)
+    {
+        chained.sa_sigaction(sig, info, context);
+    }
+    else if ((SIG_DFL != chained.sa_handler) && (SIG_IGN != chained.sa_handler))
+    {
+        chained.sa_handler(sig);
+    }
+    else
+    {
+        signal(sig, SIG_DFL);
+    }
+    errno = saved;
+}
+
+static int trap(void)
+{
+    static int installed;
+    struct sigaction action;
+
+    if (!installed)
+    {
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = fault;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &chained))
+        {
+            return -1;
+        }
+        installed = 1;
+    }
+    return 0;
+}
+
+/**
+ * SCM_TRACK_SOFTDIRTY: the kernel keeps one soft-dirty bit per page, and
+ * only lets us clear them for the whole process at once. Before clearing,
+ * the bits of every soft-dirty region are therefore moved into its
+ * bitmap. A page written by another thread between the two steps is
+ * missed; checkpoint while the region is quiescent.
+ */
+
+#define SOFT_DIRTY ((uint64_t)1 << 55)
+
+static int soft_dirty_supported(void)
+{
+    uint64_t entry;
+    char *page;
+    int fd, rc;
+
+    /* a freshly faulted page is soft-dirty, if the kernel tracks it at all */
+    rc = 0;
+    page = mmap(NULL, page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED != page)
+    {
+        page[0] = 1;
+        if (0 <= (fd = open("/proc/self/pagemap", O_RDONLY)))
+        {
+            rc = (sizeof(entry) == pread(fd, &entry, sizeof(entry), (off_t)((size_t)page / page_size() * sizeof(entry)))) &&
+                 (entry & SOFT_DIRTY);
+            close(fd);
+        }
+        munmap(page, page_size());
+    }
+    return rc;
+}
+
+static int soft_dirty_collect(void)
+{
+    uint64_t entries[512];
+    struct scm *scm;
+    size_t i, j, k, n, pages;
+    ssize_t got;
+    int fd, rc;
+
+    if (0 > (fd = open("/proc/self/pagemap", O_RDONLY)))
+    {
+        TRACE("cannot open /proc/self/pagemap");
+        return -1;
+    }
+    rc = 0;
+    for (i = 0; i < REGIONS; ++i)
+    {
+        scm = __atomic_load_n(&registry.slot[i], __ATOMIC_ACQUIRE);
+        if (!scm || (SCM_TRACK_SOFTDIRTY != scm->options.tracking))
+        {
+            continue;
+        }
+        /* pagemap has one entry per base page, even under huge pages */
+        pages = (__atomic_load_n(&scm->size, __ATOMIC_ACQUIRE) + page_size() - 1) / page_size();
+        for (j = 0; j < pages; j += n)
+        {
+            n = (pages - j < ARRAY_SIZE(entries)) ? (pages - j) : ARRAY_SIZE(entries);
+            got = pread(fd, entries, n * sizeof(uint64_t),
+                        (off_t)(((size_t)scm->base / page_size() + j) * sizeof(uint64_t)));
+            if (got != (ssize_t)(n * sizeof(uint64_t)))
+            {
+                TRACE("pagemap read error");
+                rc = -1;
+                break;
+            }
+            for (k = 0; k < n; ++k)
+            {
+                if (entries[k] & SOFT_DIRTY)
+                {
+                    dirty(scm, (char *)scm->base + (j + k) * page_size(), 1);
+                }
+            }
+        }
+    }
+    close(fd);
+    if (!rc)
+    {
+        if ((0 > (fd = open("/proc/self/clear_refs", O_WRONLY))) || (1 != write(fd, "4", 1)))
+        {
+            TRACE("cannot clear soft-dirty bits");
+            rc = -1;
+        }
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+    }
+    return rc;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const struct range *x = (const struct range *)a;
+    const struct range *y = (const struct range *)b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* flushes every page the open transaction touched, each once */
+
+static void flush_pending(struct scm *scm)
+{
+    size_t i, from, to;
+
+    if (SCM_PERSIST_CACHELINE == scm->options.persist)
+    {
+        /* a few lines each, no page to share */
+        for (i = 0; i < scm->pending; ++i)
+        {
+            persist(scm, (char *)scm->base + scm->range[i].offset, scm->range[i].length);
+        }
+        scm->pending = 0;
+        return;
+    }
+    qsort(scm->range, scm->pending, sizeof(struct range), range_cmp);
+    for (i = 0; i < scm->pending;)
+    {
+        from = scm->range[i].offset / scm->page * scm->page;
+        to = scm->range[i].offset + scm->range[i].length;
+        while ((++i < scm->pending) && (scm->range[i].offset < to + scm->page))
+        {
+            to = (to > scm->range[i].offset + scm->range[i].length) ? to : (scm->range[i].offset + scm->range[i].length);
+        }
+        flush(scm, (char *)scm->base + from, to - from);
+    }
+    scm->pending = 0;
+}
+
+/* remembers a touched range, so that scm_commit() can make it durable */
+
+static void pend(struct scm *scm, size_t offset, size_t length, int logged)
+{
+    if (PENDING == scm->pending)
+    {
+        /* early write-back of new data is harmless, undo is already durable */
+        if (SCM_ATOMIC_SYNC == scm->options.atomicity)
+        {
+            flush_pending(scm);
+        }
+        scm->pending = 0;
+    }
+    scm->range[scm->pending].offset = offset;
+    scm->range[scm->pending].length = length;
+    scm->range[scm->pending].logged = logged;
+    scm->pending++;
+}
+
+static size_t checksum(const size_t *entry, size_t words)
+{
+    size_t sum, i;
+
+    sum = (size_t)14695981039346656037UL; /* FNV-1a over words */
+    for (i = 0; i < words; ++i)
+    {
+        sum = (sum ^ ((2 == i) ? 0 : entry[i])) * (size_t)1099511628211UL;
+    }
+    return sum;
+}
+
+/**
+ * Saves the n bytes at p in the undo log before the caller overwrites
+ * them. An entry is { offset, length, checksum, old bytes padded to a
+ * word } and is appended before the log's used count moves past it; in
+ * SCM_ATOMIC_SYNC mode both reach the media before returning, and the
+ * checksum lets recovery drop an entry torn by a power failure (whose
+ * data was then never overwritten). Ranges already saved by the open
+ * transaction are skipped.
+ */
+
+static void undo(struct scm *scm, const void *p, size_t n)
+{
+    size_t *entry;
+    size_t words, i;
+
+    if (!scm->tx)
+    {
+        return;
+    }
+    for (i = 0; i < scm->pending; ++i)
+    {
+        if (scm->range[i].logged &&
+            (scm->range[i].offset == offset_of(scm, p)) &&
+            (scm->range[i].length >= n))
+        {
+            return;
+        }
+    }
+    words = 3 + (n + sizeof(size_t) - 1) / sizeof(size_t);
+    if (scm->header->used + words > LOG_WORDS)
+    {
+        EXIT("undo log overflow");
+    }
+    entry = scm->header->log + scm->header->used;
+    entry[0] = offset_of(scm, p);
+    entry[1] = n;
+    entry[words - 1] = 0;
+    memcpy(entry + 3, p, n);
+    entry[2] = checksum(entry, words);
+    __atomic_store_n(&scm->header->used, scm->header->used + words, __ATOMIC_RELEASE);
+    dirty(scm, &scm->header->used, (size_t)((char *)(entry + words) - (char *)&scm->header->used));
+    if (SCM_ATOMIC_SYNC == scm->options.atomicity)
+    {
+        persist(scm, &scm->header->used, (size_t)((char *)(entry + words) - (char *)&scm->header->used));
+    }
+    pend(scm, offset_of(scm, p), n, 1);
+}
+
+/* the transactional store every allocator metadata update goes through */
+
+static void put(struct scm *scm, size_t *p, size_t value)
+{
+    undo(scm, p, sizeof(size_t));
+    *p = value;
+    dirty(scm, p, sizeof(size_t));
+}
+
+/**
+ * Restores every valid undo entry, newest first, and empties the log.
+ * Used by scm_open() on a log left behind by a crash and by scm_abort().
+ */
+
+static void rollback(struct scm *scm)
+{
+    size_t *entry, **entries;
+    size_t used, words, n, i;
+
+    used = (scm->header->used <= LOG_WORDS) ? scm->header->used : LOG_WORDS;
+    if (!(entries = malloc((used / 4 + 1) * sizeof(size_t *))))
+    {
+        EXIT("out of memory");
+    }
+    for (n = 0, i = 0; i + 3 <= used; i += words)
+    {
+        entry = scm->header->log + i;
+        words = 3 + (entry[1] + sizeof(size_t) - 1) / sizeof(size_t);
+        if ((i + words > used) ||
+            ((entry[0] < sizeof(struct header)) &&
+             (entry[0] + entry[1] > offsetof(struct header, used))) ||
+            (entry[0] + entry[1] > scm->size) ||
+            (entry[2] != checksum(entry, words)))
+        {
+            break;
+        }
+        entries[n++] = entry;
+    }
+    while (n--)
+    {
+        memcpy((char *)scm->base + entries[n][0], entries[n] + 3, entries[n][1]);
+        dirty(scm, (char *)scm->base + entries[n][0], entries[n][1]);
+        if (SCM_ATOMIC_SYNC == scm->options.atomicity)
+        {
+            persist(scm, (char *)scm->base + entries[n][0], entries[n][1]);
+        }
+    }
+    free(entries);
+    scm->header->used = 0;
+    dirty(scm, &scm->header->used, sizeof(size_t));
+    if (SCM_ATOMIC_SYNC == scm->options.atomicity)
+    {
+        persist(scm, &scm->header->used, sizeof(size_t));
+    }
+}
+
+/**
+ * Pops a free block with a payload of at least n bytes (n already rounded
+ * to GRANULE), returning the block header or NULL if the class is empty.
+ */
+
+static size_t *recycle(struct scm *scm, size_t n)
+{
+    size_t *link, *block;
+    size_t c;
+
+    c = size_class(n);
+    link = &scm->header->free[c];
+    while (*link)
+    {
+        block = block_at(scm, *link);
+        if (block[0] >= n)
+        {
+            /* the caller overwrites the link, which a rollback relies on */
+            undo(scm, &block[1], sizeof(size_t));
+            put(scm, link, block[1]);
+            put(scm, &scm->header->freed, scm->header->freed - block[0] - sizeof(size_t));
+            put(scm, &scm->header->blocks, scm->header->blocks - 1);
+            return block;
+        }
+        if (LARGE != c)
+        {
+            break;
+        }
+        link = &block[1];
+    }
+    return NULL;
+}
+
+/**
+ * Applies scm_options.access to [from, from + n) of the mapping. Advice
+ * lives with the mapping, not the file, so every remap needs it again.
+ */
+
+static void advise(const struct scm *scm, size_t from, size_t n)
+{
+    int advice;
+
+    if ((SCM_PAGES_HUGE == scm->options.pages) && madvise((char *)scm->base + from, n, MADV_HUGEPAGE))
+    {
+        TRACE("madvise() failed");
+    }
+    switch (scm->options.access)
+    {
+    case SCM_ACCESS_RANDOM:
+        advice = MADV_RANDOM;
+        break;
+    case SCM_ACCESS_SEQUENTIAL:
+        advice = MADV_SEQUENTIAL;
+        break;
+    default:
+        return;
+    }
+    if (madvise((char *)scm->base + from, n, advice))
+    {
+        TRACE("madvise() failed");
+    }
+}
+
+/**
+ * Applies scm_options.prefault once the header is known, so that the
+ * first lookups after scm_open() do not pay a page fault per node.
+ */
+
+static void prefault(const struct scm *scm)
+{
+    volatile const char *p;
+    size_t n, i;
+
+    switch (scm->options.prefault)
+    {
+    case SCM_PREFAULT_WILLNEED:
+        /* starts reading ahead, but maps nothing */
+        if (madvise(scm->base, scm->size, MADV_WILLNEED))
+        {
+            TRACE("madvise() failed");
+        }
+        break;
+    case SCM_PREFAULT_UTILIZED:
+        n = sizeof(struct header) + scm->header->utilized;
+        n = (n < scm->size) ? n : scm->size;
+        n = (n + scm->page - 1) / scm->page * scm->page;
+        if (madvise(scm->base, n, MADV_POPULATE_READ))
+        {
+            /* before Linux 5.14, touch one byte per page */
+            for (p = (volatile const char *)scm->base, i = 0; i < n; i += scm->page)
+            {
+                (void)p[i];
+            }
+        }
+        break;
+    default:
+        break; /* SCM_PREFAULT_POPULATE is a mmap() flag */
+    }
+}
+
+/**
+ * Maps n bytes of the file from offset over the same offset of the
+ * reservation. While scm->dax holds, asks for MAP_SYNC, so that the file
+ * system keeps its metadata durable ahead of any page fault that makes a
+ * block writable; one that cannot (no DAX, or a kernel that predates it)
+ * clears scm->dax for good and gets a plain shared mapping.
+ */
+
+static int map(struct scm *scm, size_t offset, size_t n, int prot, int flags)
+{
+    void *p;
+
+    p = (char *)scm->base + offset;
+#if defined(MAP_SYNC) && defined(MAP_SHARED_VALIDATE)
+    if (scm->dax)
+    {
+        if (MAP_FAILED != mmap(p, n, prot, MAP_FIXED | MAP_SHARED_VALIDATE | MAP_SYNC | flags, scm->fd, (off_t)offset))
+        {
+            return 0;
+        }
+        if ((EOPNOTSUPP != errno) && (EINVAL != errno))
+        {
+            return -1;
+        }
+        scm->dax = 0;
+    }
+#else
+    scm->dax = 0;
+#endif
+    return (MAP_FAILED == mmap(p, n, prot, MAP_FIXED | MAP_SHARED | flags, scm->fd, (off_t)offset)) ? -1 : 0;
+}
+
+/**
+ * Extends the backing file to hold at least need bytes and maps the new
+ * tail in place, right behind the existing mapping inside the reserved
+ * range, so no byte moves and every pointer into the region stays valid.
+ */
+
+static int grow(struct scm *scm, size_t need)
+{
+    size_t size, from;
+
+    switch (scm->options.growth)
+    {
+    case SCM_GROW_DOUBLE:
+        size = scm->size * 2;
+        break;
+    case SCM_GROW_CHUNK:
+        size = scm->size + (scm->options.chunk ? scm->options.chunk : CHUNK);
+        break;
+    default:
+        return -1;
+    }
+    size = (size < need) ? need : size;
+    size = (size + scm->align - 1) / scm->align * scm->align;
+    if (size > scm->reserve)
+    {
+        if (need > scm->reserve)
+        {
+            return -1;
+        }
+        size = scm->reserve;
+    }
+
+    if (ftruncate(scm->fd, (off_t)size))
+    {
+        TRACE("ftruncate() failed");
+        return -1;
+    }
+    if (scm->pool.on)
+    {
+        /* pages are read in as they are touched, see pool_fault() */
+        __atomic_store_n(&scm->size, size, __ATOMIC_RELEASE);
+        return 0;
+    }
+    /* remap from the page holding the old end, it may have been partial */
+    from = scm->size / scm->page * scm->page;
+    if (map(scm,
+            from,
+            size - from,
+            (SCM_TRACK_WPROTECT == scm->options.tracking) ? PROT_READ : (PROT_READ | PROT_WRITE),
+            0))
+    {
+        TRACE("mmap() failed");
+        return -1;
+    }
+    advise(scm, from, size - from);
+    __atomic_store_n(&scm->size, size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* makes sure the file reaches offset top, growing it if need be */
+
+static int reach(struct scm *scm, size_t top)
+{
+    while (top > __atomic_load_n(&scm->size, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&scm->growing);
+        if ((top > scm->size) && grow(scm, top))
+        {
+            pthread_mutex_unlock(&scm->growing);
+            TRACE("out of scm memory");
+            return -1;
+        }
+        pthread_mutex_unlock(&scm->growing);
+    }
+    return 0;
+}
+
+/**
+ * Raises the known-zero mark past the bytes [from, to) just handed out.
+ * Returns non-zero if they lay entirely above the mark, i.e., were never
+ * written since the file was extended or punched.
+ */
+
+static int fresh(struct scm *scm, size_t from, size_t to)
+{
+    size_t zero;
+
+    zero = __atomic_load_n(&scm->zero, __ATOMIC_RELAXED);
+    while ((zero < to) &&
+           !__atomic_compare_exchange_n(&scm->zero, &zero, to, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        /* retry */
+    }
+    return from >= zero;
+}
+
+/**
+ * Carves a fresh block of the given total size off the bump tail,
+ * returning its first word or NULL when the region is exhausted.
+ */
+
+static size_t *bump(struct scm *scm, size_t size, int *zero)
+{
+    size_t old;
+
+    /**
+     * A compare-and-swap loop rather than a plain fetch-add, so that the
+     * offset never moves past the mapped file, not even transiently.
+     */
+    old = __atomic_load_n(&scm->header->utilized, __ATOMIC_RELAXED);
+    undo(scm, &scm->header->utilized, sizeof(size_t));
+    do
+    {
+        if (reach(scm, sizeof(struct header) + old + size))
+        {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&scm->header->utilized,
+                                          &old,
+                                          old + size,
+                                          1,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    dirty(scm, &scm->header->utilized, sizeof(size_t));
+    *zero = fresh(scm, sizeof(struct header) + old, sizeof(struct header) + old + size);
+
+    /* calculate the position of store the size */
+    return block_at(scm, sizeof(struct header) + old);
+}
+
+/**
+ * Extends the bump tail by size bytes if it currently sits at offset
+ * end, for a block ending there to grow in place.
+ */
+
+static int stretch(struct scm *scm, size_t end, size_t size)
+{
+    size_t old;
+
+    old = end - sizeof(struct header);
+    undo(scm, &scm->header->utilized, sizeof(size_t));
+    if (reach(scm, end + size) ||
+        !__atomic_compare_exchange_n(&scm->header->utilized,
+                                     &old,
+                                     old + size,
+                                     0,
+                                     __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+    dirty(scm, &scm->header->utilized, sizeof(size_t));
+    fresh(scm, end, end + size);
+    return 0;
+}
+
+/* pushes a block on its persistent class list, scm->lock held */
+
+static void share(struct scm *scm, size_t *block)
+{
+    size_t c;
+
+    c = size_class(block[0]);
+
+    /* push the block on its class list, the link lives in the payload */
+    put(scm, &block[1], scm->header->free[c]);
+    put(scm, &scm->header->free[c], offset_of(scm, block));
+    put(scm, &scm->header->freed, scm->header->freed + block[0] + sizeof(size_t));
+    put(scm, &scm->header->blocks, scm->header->blocks + 1);
+}
+
+/* hands the cached blocks of class c beyond keep to the shared list */
+
+static void cache_spill(struct cache *cache, size_t c, size_t keep)
+{
+    size_t *block;
+
+    while (cache->count[c] > keep)
+    {
+        block = block_at(cache->scm, cache->head[c]);
+        cache->head[c] = block[1];
+        cache->count[c]--;
+        share(cache->scm, block);
+    }
+}
+
+/* turns the unused rest of a span into a shared block, scm->lock held */
+
+static void cache_retire(struct cache *cache)
+{
+    size_t *block;
+
+    if (cache->end - cache->cur >= 2 * sizeof(size_t))
+    {
+        block = block_at(cache->scm, cache->cur);
+        block[0] = cache->end - cache->cur - sizeof(size_t);
+        dirty(cache->scm, block, sizeof(size_t));
+        share(cache->scm, block);
+    }
+    cache->cur = cache->end = 0;
+}
+
+/* returns everything a cache holds to the shared lists, scm->lock held */
+
+static void cache_drain(struct cache *cache)
+{
+    size_t c;
+
+    for (c = 0; c < CLASSES; ++c)
+    {
+        cache_spill(cache, c, 0);
+    }
+    cache_retire(cache);
+}
+
+/* pthread key destructor, runs when a thread that allocated exits */
+
+static void cache_exit(void *arg)
+{
+    struct cache *cache;
+    struct scm *scm;
+
+    cache = (struct cache *)arg;
+    scm = cache->scm;
+    pthread_mutex_lock(&scm->lock);
+    cache_drain(cache);
+    stats_add(&scm->stats, &cache->stats);
+    if (cache->prev)
+    {
+        cache->prev->next = cache->next;
+    }
+    else
+    {
+        scm->caches = cache->next;
+    }
+    if (cache->next)
+    {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&scm->lock);
+    free(cache);
+}
+
+static struct cache *cache_of(struct scm *scm)
+{
+    struct cache *cache;
+
+    if ((cache = pthread_getspecific(scm->key)))
+    {
+        return cache;
+    }
+    if (!(cache = malloc(sizeof(struct cache))))
+    {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(cache, 0, sizeof(struct cache));
+    cache->scm = scm;
+    if (pthread_setspecific(scm->key, cache))
+    {
+        TRACE("pthread_setspecific() failed");
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_lock(&scm->lock);
+    if ((cache->next = scm->caches))
+    {
+        cache->next->prev = cache;
+    }
+    scm->caches = cache;
+    pthread_mutex_unlock(&scm->lock);
+    return cache;
+}
+
+/**
+ * Counts an allocation of a block with n payload bytes, or its release
+ * if freed, for the calling thread: no lock, and scm_checkpoint() adds
+ * the threads up, see tally(). A compaction counts on its own.
+ */
+
+static void account(struct scm *scm, size_t n, int freed)
+{
+    struct scm_stats *stats;
+    struct cache *cache;
+
+    if (scm->compacting)
+    {
+        stats = &scm->copied;
+    }
+    else if ((cache = cache_of(scm)))
+    {
+        stats = &cache->stats;
+    }
+    else
+    {
+        return;
+    }
+    if (freed)
+    {
+        stats->frees++;
+        stats->bytes[size_class(n)] -= n;
+    }
+    else
+    {
+        stats->allocs++;
+        stats->bytes[size_class(n)] += n;
+    }
+}
+
+/* the statistics of the region as of now, scm->lock held */
+
+static void tally(const struct scm *scm, struct scm_stats *stats)
+{
+    const struct cache *cache;
+
+    *stats = scm->opened;
+    stats_add(stats, &scm->stats);
+    for (cache = scm->caches; cache; cache = cache->next)
+    {
+        stats_add(stats, &cache->stats);
+    }
+}
+
+static void *class_malloc(struct scm *scm, size_t n, int *zero)
+{
+    struct cache *cache;
+    size_t *block;
+    size_t c;
+    int z;
+
+    /* round up so that every block fits a free-list link and stays aligned */
+    n = (n + GRANULE - 1) / GRANULE * GRANULE;
+    c = size_class(n);
+
+    if (LARGE == c)
+    {
+        pthread_mutex_lock(&scm->lock);
+        block = recycle(scm, n);
+        pthread_mutex_unlock(&scm->lock);
+        *zero = 0;
+        if (!block)
+        {
+            if (!(block = bump(scm, n + sizeof(size_t), zero)))
+            {
+                return NULL;
+            }
+            *block = n;
+        }
+        return (void *)(block + 1);
+    }
+
+    if (!(cache = cache_of(scm)))
+    {
+        return NULL;
+    }
+
+    /* refill from the shared list in a batch when this thread ran dry */
+    if (!cache->head[c] && __atomic_load_n(&scm->header->free[c], __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&scm->lock);
+        while ((cache->count[c] < CACHE / 2) && (block = recycle(scm, n)))
+        {
+            put(scm, &block[1], cache->head[c]);
+            cache->head[c] = offset_of(scm, block);
+            cache->count[c]++;
+        }
+        pthread_mutex_unlock(&scm->lock);
+    }
+
+    /* prefer a recycled block of the matching class over bumping */
+    if (cache->head[c])
+    {
+        block = block_at(scm, cache->head[c]);
+        cache->head[c] = block[1];
+        cache->count[c]--;
+        *zero = 0;
+        return (void *)(block + 1);
+    }
+
+    if (cache->end - cache->cur < n + sizeof(size_t))
+    {
+        if (!(block = bump(scm, SPAN, &z)))
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&scm->lock);
+        cache_retire(cache);
+        pthread_mutex_unlock(&scm->lock);
+        cache->cur = offset_of(scm, block);
+        cache->end = cache->cur + SPAN;
+        cache->fresh = z ? cache->cur : cache->end;
+    }
+    *zero = (cache->cur >= cache->fresh);
+    block = block_at(scm, cache->cur);
+    block[0] = n;
+    cache->cur += n + sizeof(size_t);
+
+    /* move the pointer to the actual start of the allocated block */
+    return (void *)(block + 1);
+}
+
+static void class_free(struct scm *scm, size_t *block)
+{
+    struct cache *cache;
+    size_t c;
+
+    c = size_class(block[0]);
+    if ((LARGE == c) || !(cache = cache_of(scm)))
+    {
+        pthread_mutex_lock(&scm->lock);
+        share(scm, block);
+        pthread_mutex_unlock(&scm->lock);
+        return;
+    }
+    put(scm, &block[1], cache->head[c]);
+    cache->head[c] = offset_of(scm, block);
+    if (++cache->count[c] > CACHE)
+    {
+        pthread_mutex_lock(&scm->lock);
+        cache_spill(cache, c, CACHE / 2);
+        pthread_mutex_unlock(&scm->lock);
+    }
+}
+
+static size_t bin_of(size_t size)
+{
+    size_t b;
+
+    if (size < 1024)
+    {
+        return size / 16;
+    }
+    for (b = 64, size >>= 11; size; size >>= 1)
+    {
+        ++b;
+    }
+    return (b < BINS) ? b : (BINS - 1);
+}
+
+/* links a free block into its bin, keeping the bin sorted by size */
+
+static void fit_link(struct scm *scm, size_t *block)
+{
+    size_t size, b, prev, next;
+
+    size = block[0] & ~(size_t)FIT_FLAGS;
+    b = bin_of(size);
+    prev = 0;
+    next = scm->header->bins[b];
+    while (next && ((block_at(scm, next)[0] & ~(size_t)FIT_FLAGS) < size))
+    {
+        prev = next;
+        next = block_at(scm, next)[1];
+    }
+    put(scm, &block[1], next);
+    put(scm, &block[2], prev);
+    if (next)
+    {
+        put(scm, &block_at(scm, next)[2], offset_of(scm, block));
+    }
+    if (prev)
+    {
+        put(scm, &block_at(scm, prev)[1], offset_of(scm, block));
+    }
+    else
+    {
+        put(scm, &scm->header->bins[b], offset_of(scm, block));
+        put(scm, &scm->header->map[b / 64], scm->header->map[b / 64] | (size_t)1 << (b % 64));
+    }
+    put(scm, &scm->header->freed, scm->header->freed + size);
+    put(scm, &scm->header->blocks, scm->header->blocks + 1);
+}
+
+static void fit_unlink(struct scm *scm, size_t *block)
+{
+    size_t size, b;
+
+    size = block[0] & ~(size_t)FIT_FLAGS;
+    b = bin_of(size);
+    if (block[1])
+    {
+        put(scm, &block_at(scm, block[1])[2], block[2]);
+    }
+    if (block[2])
+    {
+        put(scm, &block_at(scm, block[2])[1], block[1]);
+    }
+    else
+    {
+        put(scm, &scm->header->bins[b], block[1]);
+        if (!block[1])
+        {
+            put(scm, &scm->header->map[b / 64], scm->header->map[b / 64] & ~((size_t)1 << (b % 64)));
+        }
+    }
+    put(scm, &scm->header->freed, scm->header->freed - size);
+    put(scm, &scm->header->blocks, scm->header->blocks - 1);
+}
+
+/* returns the smallest free block of at least size bytes, or NULL */
+
+static size_t *fit_find(struct scm *scm, size_t size)
+{
+    size_t b, next;
+    size_t bits;
+
+    b = bin_of(size);
+    for (next = scm->header->bins[b]; next; next = block_at(scm, next)[1])
+    {
+        if ((block_at(scm, next)[0] & ~(size_t)FIT_FLAGS) >= size)
+        {
+            return block_at(scm, next);
+        }
+    }
+    for (++b; b < BINS; b = (b | 63) + 1)
+    {
+        if ((bits = scm->header->map[b / 64] >> (b % 64)))
+        {
+            b += (size_t)__builtin_ctzl(bits);
+            return block_at(scm, scm->header->bins[b]);
+        }
+    }
+    return NULL;
+}
+
+static void *fit_malloc(struct scm *scm, size_t n, int *zero)
+{
+    size_t *block, *next;
+    size_t size, rest;
+
+    size = (n + sizeof(size_t) + FIT_FLAGS) & ~(size_t)FIT_FLAGS;
+    size = (size < FIT_MIN) ? FIT_MIN : size;
+
+    *zero = 0;
+    if ((block = fit_find(scm, size)))
+    {
+        /* the caller overwrites links and footer, a rollback needs them */
+        undo(scm, &block[1], 2 * sizeof(size_t));
+        undo(scm, &block[(block[0] & ~(size_t)FIT_FLAGS) / sizeof(size_t) - 1], sizeof(size_t));
+        fit_unlink(scm, block);
+        rest = (block[0] & ~(size_t)FIT_FLAGS) - size;
+        if (rest >= FIT_MIN)
+        {
+            /* split, the tail goes back into the index */
+            /* a punched block stays punched in both parts, see scm_calloc() */
+            next = block + size / sizeof(size_t);
+            put(scm, &next[0], rest | FIT_PREV | (block[0] & FIT_PUNCHED));
+            put(scm, &block[0], size | FIT_ALLOC | (block[0] & (FIT_PREV | FIT_PUNCHED)));
+            put(scm, &next[rest / sizeof(size_t) - 1], rest);
+            fit_link(scm, next);
+        }
+        else
+        {
+            size += rest;
+            put(scm, &block[0], block[0] | FIT_ALLOC);
+            next = block + size / sizeof(size_t);
+            if (offset_of(scm, next) < sizeof(struct header) + scm->header->utilized)
+            {
+                put(scm, &next[0], next[0] | FIT_PREV);
+            }
+        }
+        return (void *)(block + 1);
+    }
+
+    /* the block below the tail is always in use, see fit_free() */
+    if (!(block = bump(scm, size, zero)))
+    {
+        return NULL;
+    }
+    block[0] = size | FIT_ALLOC | FIT_PREV;
+    return (void *)(block + 1);
+}
+
+static void fit_free(struct scm *scm, size_t *block)
+{
+    size_t *next;
+    size_t size, top;
+
+    size = block[0] & ~(size_t)FIT_FLAGS;
+    next = block + size / sizeof(size_t);
+    top = sizeof(struct header) + scm->header->utilized;
+
+    if (!(block[0] & FIT_PREV))
+    {
+        /* merge with the free block below, found through its footer */
+        block -= block[-1] / sizeof(size_t);
+        fit_unlink(scm, block);
+        size += block[0] & ~(size_t)FIT_FLAGS;
+    }
+    if (offset_of(scm, next) < top)
+    {
+        if (!(next[0] & FIT_ALLOC))
+        {
+            /* merge with the free block above */
+            fit_unlink(scm, next);
+            size += next[0] & ~(size_t)FIT_FLAGS;
+        }
+        else
+        {
+            put(scm, &next[0], next[0] & ~(size_t)FIT_PREV);
+        }
+    }
+    else
+    {
+        /* the block was the last one, give it back to the bump tail */
+        undo(scm, &scm->header->utilized, sizeof(size_t));
+        __atomic_store_n(&scm->header->utilized,
+                         offset_of(scm, block) - sizeof(struct header),
+                         __ATOMIC_RELEASE);
+        dirty(scm, &scm->header->utilized, sizeof(size_t));
+        return;
+    }
+
+    put(scm, &block[0], size | FIT_PREV);
+    put(scm, &block[size / sizeof(size_t) - 1], size);
+    fit_link(scm, block);
+}
+
+/* grows a block in place into its thread's span or the bump tail */
+
+static int class_resize(struct scm *scm, size_t *block, size_t n)
+{
+    struct cache *cache;
+    size_t end;
+
+    n = (n + GRANULE - 1) / GRANULE * GRANULE;
+    if (n <= block[0])
+    {
+        return 0;
+    }
+    end = offset_of(scm, block) + sizeof(size_t) + block[0];
+    cache = pthread_getspecific(scm->key);
+    if (cache && (end == cache->cur) && (cache->end - cache->cur >= n - block[0]))
+    {
+        cache->cur += n - block[0];
+    }
+    else if (stretch(scm, end, n - block[0]))
+    {
+        return -1;
+    }
+    put(scm, &block[0], n);
+    return 0;
+}
+
+/**
+ * Resizes a block in place: shrinking frees its tail, growing takes the
+ * bump tail or the free block above, whichever follows. scm->lock held.
+ */
+
+static int fit_resize(struct scm *scm, size_t *block, size_t n)
+{
+    size_t size, want, more, rest, top;
+    size_t *next;
+
+    want = (n + sizeof(size_t) + FIT_FLAGS) & ~(size_t)FIT_FLAGS;
+    want = (want < FIT_MIN) ? FIT_MIN : want;
+    size = block[0] & ~(size_t)FIT_FLAGS;
+    next = block + size / sizeof(size_t);
+    top = sizeof(struct header) + scm->header->utilized;
+
+    if (want <= size)
+    {
+        if (size - want >= FIT_MIN)
+        {
+            /* carve the tail off as an allocated block, then free it */
+            put(scm, &block[0], want | FIT_ALLOC | (block[0] & FIT_PREV));
+            next = block + want / sizeof(size_t);
+            put(scm, &next[0], (size - want) | FIT_ALLOC | FIT_PREV);
+            fit_free(scm, next);
+        }
+        return 0;
+    }
+    if (offset_of(scm, next) == top)
+    {
+        if (stretch(scm, top, want - size))
+        {
+            return -1;
+        }
+        put(scm, &block[0], want | FIT_ALLOC | (block[0] & FIT_PREV));
+        return 0;
+    }
+    more = next[0] & ~(size_t)FIT_FLAGS;
+    if ((next[0] & FIT_ALLOC) || (size + more < want))
+    {
+        return -1;
+    }
+
+    /* the caller overwrites the tag, links and footer, a rollback needs them */
+    undo(scm, next, 3 * sizeof(size_t));
+    undo(scm, &next[more / sizeof(size_t) - 1], sizeof(size_t));
+    fit_unlink(scm, next);
+    rest = size + more - want;
+    if (rest >= FIT_MIN)
+    {
+        put(scm, &block[0], want | FIT_ALLOC | (block[0] & FIT_PREV));
+        next = block + want / sizeof(size_t);
+        put(scm, &next[0], rest | FIT_PREV);
+        put(scm, &next[rest / sizeof(size_t) - 1], rest);
+        fit_link(scm, next);
+    }
+    else
+    {
+        put(scm, &block[0], (size + more) | FIT_ALLOC | (block[0] & FIT_PREV));
+        next = block + (size + more) / sizeof(size_t);
+        if (offset_of(scm, next) < top)
+        {
+            put(scm, &next[0], next[0] | FIT_PREV);
+        }
+    }
+    return 0;
+}
+
+/* returns the slab whose SLAB bytes hold offset */
+
+static struct slab *slab_of(const struct scm *scm, size_t offset)
+{
+    return (struct slab *)((char *)scm->base + offset / SLAB * SLAB + sizeof(size_t));
+}
+
+/**
+ * Carves a new slab off the tail, scm->lock held. The bytes skipped to
+ * reach a SLAB boundary become a free block, or while compacting, where
+ * nothing is freed, an allocated one that is never used.
+ */
+
+static struct slab *slab_new(struct scm *scm, size_t size)
+{
+    struct slab *slab;
+    size_t *block;
+    size_t bias, old, at, lead;
+
+    bias = scm->compacting ? (scm->header->compact - sizeof(struct header)) : 0;
+    old = __atomic_load_n(&scm->header->utilized, __ATOMIC_RELAXED);
+    undo(scm, &scm->header->utilized, sizeof(size_t));
+    do
+    {
+        at = sizeof(struct header) + old;
+        lead = (SLAB - (at - bias) % SLAB) % SLAB;
+        if (lead && (lead < FIT_MIN))
+        {
+            lead += SLAB;
+        }
+        if (reach(scm, at + lead + SLAB))
+        {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&scm->header->utilized,
+                                          &old,
+                                          old + lead + SLAB,
+                                          1,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    dirty(scm, &scm->header->utilized, sizeof(size_t));
+    fresh(scm, at, at + lead + SLAB);
+
+    /* new memory, durable at commit like any allocation */
+    dirty(scm, (char *)scm->base + at, lead + SLAB_HEAD);
+    if (scm->tx)
+    {
+        pend(scm, at, lead + SLAB_HEAD, 0);
+    }
+    block = block_at(scm, at + lead);
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        block[0] = SLAB | FIT_ALLOC | FIT_PREV;
+    }
+    else
+    {
+        block[0] = SLAB - sizeof(size_t);
+    }
+    if (lead)
+    {
+        block = block_at(scm, at);
+        if (SCM_ALLOC_FIT == scm->header->mode)
+        {
+            block[0] = lead | FIT_ALLOC | FIT_PREV;
+            if (!scm->compacting)
+            {
+                fit_free(scm, block);
+            }
+        }
+        else
+        {
+            block[0] = lead - sizeof(size_t);
+            if (!scm->compacting)
+            {
+                share(scm, block);
+            }
+        }
+    }
+    slab = (struct slab *)(block_at(scm, at + lead) + 1);
+    memset(slab, 0, SLAB_HEAD - sizeof(size_t));
+    slab->size = size;
+    return slab;
+}
+
+/* returns the pool of objects of size bytes, claiming one if need be */
+
+static size_t pool_of(struct scm *scm, size_t size)
+{
+    size_t i, unused;
+
+    unused = POOLS;
+    for (i = 0; i < POOLS; ++i)
+    {
+        if (size == scm->header->pools[i].size)
+        {
+            return i;
+        }
+        if (!scm->header->pools[i].size && (POOLS == unused))
+        {
+            unused = i;
+        }
+    }
+    if (POOLS != unused)
+    {
+        put(scm, &scm->header->pools[unused].size, size);
+    }
+    return unused;
+}
+
+/**
+ * Returns the page size of the file system holding fd: that of its huge
+ * pages on hugetlbfs, where mappings, file sizes and msync() all work in
+ * whole huge pages, and the base page size anywhere else.
+ */
+
+static size_t huge_page(int fd)
+{
+    struct statfs info;
+
+    if (!fstatfs(fd, &info) && (HUGETLBFS_MAGIC == (unsigned long)info.f_type))
+    {
+        return (size_t)info.f_bsize;
+    }
+    return page_size();
+}
+
+/**
+ * Reserves n bytes of address space starting at a multiple of align, by
+ * over-reserving and trimming the excess on both sides.
+ */
+
+static void *reserve(size_t n, size_t align)
+{
+    char *p, *q;
+
+    p = mmap(NULL, n + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == p)
+    {
+        return NULL;
+    }
+    q = (char *)(((size_t)p + align - 1) / align * align);
+    if (q > p)
+    {
+        munmap(p, (size_t)(q - p));
+    }
+    munmap(q + n, (size_t)(p + align - q));
+    return q;
+}
+
+/**
+ * Gives the whole pages inside [from, to) back to the file system: the
+ * file gets a hole there and the page cache drops them. They read back
+ * as zeros, which is fine for the inside of a free block, where only the
+ * first words and the footer carry allocator metadata.
+ */
+
+static size_t punch(struct scm *scm, size_t from, size_t to)
+{
+    size_t i, j, k, n;
+
+    from = (from + scm->page - 1) / scm->page * scm->page;
+    to = to / scm->page * scm->page;
+    if ((from >= to) || __atomic_load_n(&scm->snapping, __ATOMIC_ACQUIRE))
+    {
+        /* a snapshot yet to copy the pages would see zeros */
+        return 0;
+    }
+    if (scm->pool.on)
+    {
+        /**
+         * The frames read back as zeros too, once dropped. Pinned pages
+         * are left alone, in the file and in the pool: scm_pin() promised
+         * them resident, and their frames would no longer match the file.
+         */
+        pool_lock(scm);
+        for (n = 0, i = from / scm->page; i < to / scm->page; i = j)
+        {
+            j = i + 1;
+            if (bit_test(scm->pool.pinned, i))
+            {
+                continue;
+            }
+            /* the run of unpinned pages from i */
+            while ((j < to / scm->page) && !bit_test(scm->pool.pinned, j))
+            {
+                ++j;
+            }
+            if (fallocate(scm->fd,
+                          FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)(i * scm->page),
+                          (off_t)((j - i) * scm->page)))
+            {
+                TRACE("cannot punch holes");
+                break;
+            }
+            for (k = i; k < j; ++k)
+            {
+                if (bit_test(scm->pool.resident, k))
+                {
+                    pool_drop(scm, k);
+                }
+            }
+            n += (j - i) * scm->page;
+        }
+        pool_unlock(scm);
+        return n;
+    }
+    if (fallocate(scm->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)from, (off_t)(to - from)) &&
+        madvise((char *)scm->base + from, to - from, MADV_REMOVE))
+    {
+        TRACE("cannot punch holes");
+        return 0;
+    }
+    return to - from;
+}
+
+/**
+ * Returns the offset past which the backing file holds no data, i.e.,
+ * past the last extent that is neither a hole nor beyond its end, given
+ * that there is none below from. Used to know memory zero without
+ * reading it, see scm_calloc().
+ */
+
+static size_t zero_mark(const struct scm *scm, size_t from)
+{
+    off_t data, hole;
+
+    hole = (off_t)from;
+    while (0 <= (data = lseek(scm->fd, hole, SEEK_DATA)))
+    {
+        if (0 > (hole = lseek(scm->fd, data, SEEK_HOLE)))
+        {
+            return scm->size;
+        }
+    }
+    return (ENXIO == errno) ? (size_t)hole : scm->size;
+}
+
+/**
+ * Ends a compaction whose copy is complete and durable: moves the copy
+ * down to the start of the data area and forgets every other block.
+ * After a crash this simply runs again from scm_open().
+ *
+ * The copy moves down by shift bytes, front to back, in steps of at most
+ * shift bytes: each step only overwrites source bytes already moved, so
+ * the rest of the copy is intact when a rerun resumes from moved. A copy
+ * no longer than shift, the usual case, goes in one step. A longer one,
+ * such as a compact tree laid out anew, records its progress after each
+ * step. scm->lock or exclusive access held.
+ */
+
+static void relocate(struct scm *scm)
+{
+    struct cache *cache;
+    struct slab *slab;
+    size_t n, i, k, shift;
+
+    n = scm->header->moving;
+    shift = scm->header->compact - sizeof(struct header);
+    while (scm->header->moved < n)
+    {
+        i = scm->header->moved;
+        k = (shift && (n - i > shift)) ? shift : (n - i);
+        memmove((char *)scm->base + sizeof(struct header) + i, (char *)scm->base + scm->header->compact + i, k);
+        flush(scm, (char *)scm->base + sizeof(struct header) + i, k);
+        if (i + k == n)
+        {
+            /* the last step is redone after a crash, its source is intact */
+            break;
+        }
+        scm->header->moved = i + k;
+        flush(scm, &scm->header->moved, sizeof(size_t));
+    }
+
+    memset(scm->header->free, 0, sizeof(scm->header->free));
+    memset(scm->header->bins, 0, sizeof(scm->header->bins));
+    memset(scm->header->map, 0, sizeof(scm->header->map));
+    scm->header->freed = 0;
+    scm->header->blocks = 0;
+    for (i = 0; i < POOLS; ++i)
+    {
+        /**
+         * Slabs filled before the last fresh one are full. That one is
+         * the only partial slab, unless it filled up too. fresh is left
+         * as is until the next compaction, for a rerun.
+         */
+        scm->header->pools[i].partial = 0;
+        if (scm->header->pools[i].fresh)
+        {
+            slab = slab_of(scm, scm->header->pools[i].fresh - shift);
+            if (slab->used < (SLAB - SLAB_HEAD) / slab->size)
+            {
+                scm->header->pools[i].partial = scm->header->pools[i].fresh - shift;
+            }
+        }
+    }
+    __atomic_store_n(&scm->header->utilized, n, __ATOMIC_RELEASE);
+    scm->header->compact = 0;
+    scm->header->moving = 0;
+    scm->header->moved = 0;
+    flush(scm, scm->header, sizeof(struct header));
+
+    for (cache = scm->caches; cache; cache = cache->next)
+    {
+        memset(cache->head, 0, sizeof(cache->head));
+        memset(cache->count, 0, sizeof(cache->count));
+        cache->cur = cache->end = 0;
+    }
+    punch(scm, sizeof(struct header) + n, scm->size);
+    scm->zero = zero_mark(scm, sizeof(struct header) + n);
+}
+
+/* scm_malloc() during a compaction: blocks are bumped back to back */
+
+static void *compact_malloc(struct scm *scm, size_t n, int *zero)
+{
+    size_t *block;
+    size_t size;
+
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        size = (n + sizeof(size_t) + FIT_FLAGS) & ~(size_t)FIT_FLAGS;
+        size = (size < FIT_MIN) ? FIT_MIN : size;
+        if (!(block = bump(scm, size, zero)))
+        {
+            return NULL;
+        }
+        block[0] = size | FIT_ALLOC | FIT_PREV;
+    }
+    else
+    {
+        n = (n + GRANULE - 1) / GRANULE * GRANULE;
+        if (!(block = bump(scm, n + sizeof(size_t), zero)))
+        {
+            return NULL;
+        }
+        block[0] = n;
+    }
+    return (void *)(block + 1);
+}
+
+/**
+ * The optional background flusher: runs a checkpoint every flush_ms, or
+ * as soon as flush_bytes of pages are dirty, or when scm_barrier() asks.
+ * Requests that arrive during a checkpoint are served together by the
+ * next one, which is what makes scm_barrier() a group commit.
+ */
+
+static void *flusher(void *arg)
+{
+    struct scm *scm = (struct scm *)arg;
+    struct timespec deadline;
+    size_t ticket;
+    int rc;
+
+    for (;;)
+    {
+        if (scm->options.flush_ms)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += scm->options.flush_ms / 1000;
+            deadline.tv_nsec += (long)(scm->options.flush_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_nsec -= 1000000000;
+                ++deadline.tv_sec;
+            }
+            while (sem_timedwait(&scm->wake, &deadline) && (EINTR == errno))
+            {
+                /* retry */
+            }
+        }
+        else
+        {
+            while (sem_wait(&scm->wake) && (EINTR == errno))
+            {
+                /* retry */
+            }
+        }
+        while (!sem_trywait(&scm->wake))
+        {
+            /* one checkpoint serves every request so far */
+        }
+        if (__atomic_load_n(&scm->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        pthread_mutex_lock(&scm->barrier);
+        ticket = ++scm->started;
+        pthread_mutex_unlock(&scm->barrier);
+        rc = scm_checkpoint(scm, NULL);
+        pthread_mutex_lock(&scm->barrier);
+        scm->completed = ticket;
+        scm->failed = rc;
+        pthread_cond_broadcast(&scm->flushed);
+        pthread_mutex_unlock(&scm->barrier);
+    }
+    return NULL;
+}
+
+/* checks the rest of the superblock, past MAGIC, see scm_open() */
+
+static int superblock(const struct scm *scm)
+{
+    const struct header *header;
+
+    header = scm->header;
+    if (VERSION != header->version)
+    {
+        TRACE("unsupported format version");
+        return -1;
+    }
+    if ((SCM_ALLOC_FIT < header->mode) ||
+        (sizeof(struct header) + sizeof(size_t) != header->root) ||
+        (header->utilized > scm->size - sizeof(struct header)))
+    {
+        TRACE("corrupt superblock");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The write-ahead log is a pair of append-only files next to the backing
+ * file, pathname.wal.0 and pathname.wal.1, holding records of the form
+ * below, each followed by its n bytes. Records are numbered from 1 on in
+ * append order, and the region remembers the last one applied in the
+ * same transaction as its effects, so that replay skips exactly what a
+ * checkpoint made durable. Appends go to one file while a checkpoint
+ * empties the other, see wal_rotate() and wal_trim().
+ */
+
+struct record
+{
+    uint64_t lsn;  /* sequence number */
+    uint32_t type; /* chosen by the caller */
+    uint32_t n;    /* bytes that follow */
+    uint64_t sum;  /* of the above and the bytes, a torn tail fails it */
+};
+
+/* FNV-1a over a record and its bytes, see checksum() */
+
+static uint64_t record_sum(const struct record *record, const void *p)
+{
+    const unsigned char *c;
+    uint64_t sum;
+    size_t i;
+
+    sum = (uint64_t)14695981039346656037UL;
+    c = (const unsigned char *)record;
+    for (i = 0; i < offsetof(struct record, sum); ++i)
+    {
+        sum = (sum ^ c[i]) * (uint64_t)1099511628211UL;
+    }
+    c = (const unsigned char *)p;
+    for (i = 0; i < record->n; ++i)
+    {
+        sum = (sum ^ c[i]) * (uint64_t)1099511628211UL;
+    }
+    return sum;
+}
+
+/**
+ * Reads log file i and passes each record past header->lsn to fnc, or to
+ * none to only find its last record. A torn tail, what was being written
+ * when the system went down, is cut off. Returns -1 on error or when fnc
+ * fails.
+ */
+
+static int wal_read(struct scm *scm, int i, scm_wal_fnc_t fnc, void *arg)
+{
+    const struct record *record;
+    struct stat info;
+    size_t pos, last;
+    char *buf;
+    int rc;
+
+    if (fstat(scm->wal[i], &info))
+    {
+        TRACE("fstat() failed");
+        return -1;
+    }
+    if (!info.st_size)
+    {
+        scm->last[i] = 0;
+        return 0;
+    }
+    if (!(buf = malloc((size_t)info.st_size)))
+    {
+        TRACE("out of memory");
+        return -1;
+    }
+    if ((ssize_t)info.st_size != pread(scm->wal[i], buf, (size_t)info.st_size, 0))
+    {
+        TRACE("pread() failed");
+        free(buf);
+        return -1;
+    }
+    rc = 0;
+    pos = last = 0;
+    while (!rc && (sizeof(struct record) <= (size_t)info.st_size - pos))
+    {
+        record = (const struct record *)(buf + pos);
+        if ((record->n > (size_t)info.st_size - pos - sizeof(struct record)) ||
+            (record->lsn <= last) ||
+            (record->sum != record_sum(record, record + 1)))
+        {
+            break;
+        }
+        if (fnc && (record->lsn > scm->header->lsn))
+        {
+            scm->replay = record->lsn;
+            rc = fnc(arg, (int)record->type, record + 1, record->n);
+            scm->replay = 0;
+        }
+        last = record->lsn;
+        pos += sizeof(struct record) + record->n;
+    }
+    free(buf);
+    if (!rc && (pos < (size_t)info.st_size) && ftruncate(scm->wal[i], (off_t)pos))
+    {
+        TRACE("ftruncate() failed");
+        return -1;
+    }
+    scm->last[i] = last;
+    return rc;
+}
+
+/* empties log file i, its records are all applied and durable */
+
+static int wal_truncate(struct scm *scm, int i)
+{
+    if (ftruncate(scm->wal[i], 0))
+    {
+        TRACE("ftruncate() failed");
+        return -1;
+    }
+    scm->last[i] = 0;
+    scm->unsynced[i] = 0;
+    return 0;
+}
+
+/**
+ * Opens the log files of scm_options.wal, emptied when truncating, and
+ * finds where numbering resumes. Records left from before a crash stay
+ * until scm_wal_replay().
+ */
+
+static int wal_open(struct scm *scm, const char *pathname, int truncate)
+{
+    char *name;
+    size_t n;
+    int i;
+
+    n = safe_strlen(pathname) + sizeof(".wal.0");
+    if (!(name = malloc(n)))
+    {
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        safe_sprintf(name, n, "%s.wal.%d", pathname, i);
+        if (0 > (scm->wal[i] = open(name, O_RDWR | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), S_IRUSR | S_IWUSR)))
+        {
+            TRACE("open file failed");
+            free(name);
+            return -1;
+        }
+        if (wal_read(scm, i, NULL, NULL) || fdatasync(scm->wal[i]))
+        {
+            free(name);
+            return -1;
+        }
+    }
+    free(name);
+
+    /* appends go after the newer file's records */
+    scm->cur = (scm->last[1] > scm->last[0]) ? 1 : 0;
+    scm->next = scm->header->lsn;
+    scm->next = (scm->last[0] > scm->next) ? scm->last[0] : scm->next;
+    scm->next = (scm->last[1] > scm->next) ? scm->last[1] : scm->next;
+    scm->synced = scm->next++;
+    scm->applied = scm->header->lsn;
+    return 0;
+}
+
+/**
+ * Starts a checkpoint's part in the log: when the file not appended to is
+ * empty, appends switch to it, and the other one holds records up to *last
+ * to be dropped once the checkpoint is over. *applied is the last record
+ * whose writes the checkpoint is certain to see. Returns the file to trim.
+ */
+
+static int wal_rotate(struct scm *scm, size_t *last, size_t *applied)
+{
+    int old;
+
+    pthread_mutex_lock(&scm->logging);
+    if (!scm->last[1 - scm->cur] && scm->last[scm->cur])
+    {
+        scm->cur = 1 - scm->cur;
+    }
+    old = 1 - scm->cur;
+    *last = scm->last[old];
+    *applied = scm->applied;
+    pthread_mutex_unlock(&scm->logging);
+    return old;
+}
+
+/**
+ * Ends a checkpoint's part in the log: file old is emptied if all of its
+ * records were applied before the checkpoint started and are now on disk
+ * with the region. Otherwise, a transaction was still open, and the next
+ * checkpoint will see it through.
+ */
+
+static void wal_trim(struct scm *scm, int old, size_t last, size_t applied)
+{
+    pthread_mutex_lock(&scm->logging);
+    if (last && (last <= applied) && (last == scm->last[old]))
+    {
+        wal_truncate(scm, old);
+    }
+    pthread_mutex_unlock(&scm->logging);
+}
+
+/**
+ * Sets up SCM_BACKEND_BUFFER for scm_open(), which then maps nothing: the
+ * header pages are pinned, and the frames are read through a second
+ * descriptor with O_DIRECT, or through the page cache where the file
+ * system refuses it (tmpfs, ...).
+ */
+
+static int pool_open(struct scm *scm, const char *pathname)
+{
+    size_t words, i;
+
+    if ((SCM_PAGES_BASE != scm->options.pages) || (scm->page != page_size()))
+    {
+        TRACE("the buffer pool needs base pages");
+        return -1;
+    }
+    if (0 <= (scm->pool.fd = open(pathname, O_RDWR | O_DIRECT)))
+    {
+        scm->pool.stats.direct = 1;
+    }
+    else
+    {
+        scm->pool.fd = scm->fd;
+    }
+    scm->pool.on = 1;
+    /* every write faults anyway, see pool_fault() */
+    scm->options.tracking = SCM_TRACK_BITMAP;
+    scm->pool.stats.frames = (scm->options.pool ? scm->options.pool : POOL) / scm->page;
+    scm->pool.head = (sizeof(struct header) + scm->page - 1) / scm->page;
+    if (scm->pool.stats.frames < scm->pool.head + POOL_FREE)
+    {
+        TRACE("buffer pool too small");
+        return -1;
+    }
+    words = (scm->reserve / scm->page + 63) / 64;
+    if (!(scm->pool.clock = calloc(scm->pool.stats.frames, sizeof(size_t))) ||
+        !(scm->pool.resident = calloc(words, sizeof(size_t))) ||
+        !(scm->pool.referenced = calloc(words, sizeof(size_t))) ||
+        !(scm->pool.written = calloc(words, sizeof(size_t))) ||
+        !(scm->pool.pinned = calloc(words, sizeof(size_t))))
+    {
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < scm->pool.head; ++i)
+    {
+        bit_set(scm->pool.pinned, i);
+    }
+    scm->pool.stats.pinned = scm->pool.head;
+    if (trap())
+    {
+        TRACE("sigaction() failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Initializes an SCM region using the file specified in pathname as the
+ * backing device, opening the regsion for memory allocation activities.
+ * Address space for options->reserve bytes is set aside up front so that
+ * the file can later grow in place, see grow(). Up to REGIONS files may be
+ * open at once, each in its own range; a file can only be open once.
+ *
+ * pathname: the file pathname of the backing device
+ * truncate: if non-zero, truncates the SCM region, clearning all data
+ * options : open-time settings, NULL selects the defaults
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct scm *scm_open(const char *pathname, int truncate, const struct scm_options *options)
+{
+    struct scm *scm;
+    struct stat info;
+    size_t magic;
+
+    if (!(scm = malloc(sizeof(struct scm))))
+    {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(scm, 0, sizeof(struct scm));
+    scm->slot = -1;
+    scm->wal[0] = scm->wal[1] = -1;
+    if (options)
+    {
+        scm->options = *options;
+    }
+    if (scm->options.alignment & (scm->options.alignment - 1))
+    {
+        TRACE("alignment not a power of two");
+        release(scm);
+        return NULL;
+    }
+
+    if ((scm->fd = open(pathname, O_RDWR, S_IRUSR | S_IWUSR)) < 0)
+    {
+        TRACE("open file failed");
+        release(scm);
+        return NULL;
+    }
+    if (fstat(scm->fd, &info))
+    {
+        TRACE("fstat() failed");
+        release(scm);
+        return NULL;
+    }
+    if (!S_ISREG(info.st_mode))
+    {
+        TRACE("not a regular file");
+        release(scm);
+        return NULL;
+    }
+    /* nothing is mapped, grown or written before this */
+    magic = 0;
+    if (!truncate &&
+        ((sizeof(size_t) != pread(scm->fd, &magic, sizeof(size_t), 0)) || (MAGIC != magic)))
+    {
+        TRACE(magic ? "not an SCM region, or one older than the superblock" : "not an SCM region");
+        release(scm);
+        return NULL;
+    }
+    /* two handles on one file would keep diverging allocator state */
+    if (flock(scm->fd, LOCK_EX | LOCK_NB))
+    {
+        TRACE("file already open");
+        release(scm);
+        return NULL;
+    }
+    if (registry_claim(scm))
+    {
+        TRACE("too many open regions");
+        release(scm);
+        return NULL;
+    }
+    if (pthread_key_create(&scm->key, cache_exit))
+    {
+        TRACE("pthread_key_create() failed");
+        release(scm);
+        return NULL;
+    }
+    pthread_mutex_init(&scm->lock, NULL);
+    pthread_mutex_init(&scm->growing, NULL);
+    pthread_mutex_init(&scm->barrier, NULL);
+    pthread_cond_init(&scm->flushed, NULL);
+    pthread_mutex_init(&scm->logging, NULL);
+    pthread_cond_init(&scm->logged, NULL);
+    sem_init(&scm->wake, 0, 0);
+    scm->ready = 1;
+    if ((SCM_TRACK_WPROTECT == scm->options.tracking) && trap())
+    {
+        TRACE("sigaction() failed");
+        release(scm);
+        return NULL;
+    }
+
+    scm->size = info.st_size;
+    scm->page = huge_page(scm->fd);
+    scm->align = (SCM_PAGES_HUGE == scm->options.pages) ? HUGE : scm->page;
+    scm->align = (scm->align < scm->page) ? scm->page : scm->align;
+    scm->reserve = scm->options.reserve ? scm->options.reserve : RESERVE;
+    scm->reserve = (scm->reserve < scm->size) ? scm->size : scm->reserve;
+    scm->reserve = (scm->reserve + scm->align - 1) / scm->align * scm->align;
+    if (!(scm->dirty = calloc((scm->reserve / scm->page + 63) / 64, sizeof(size_t))))
+    {
+        TRACE("out of memory");
+        release(scm);
+        return NULL;
+    }
+    if ((SCM_BACKEND_BUFFER == scm->options.backend) &&
+        (SCM_PERSIST_CACHELINE == scm->options.persist))
+    {
+        TRACE("cache-line persistence needs a mapping");
+        release(scm);
+        return NULL;
+    }
+    if ((SCM_BACKEND_BUFFER == scm->options.backend) && pool_open(scm, pathname))
+    {
+        release(scm);
+        return NULL;
+    }
+
+    /**
+     * Reserve the whole growth range wherever the kernel sees fit, then map
+     * the file over its start. MAP_FIXED is only ever used inside our own
+     * reservation, and the region holds no absolute pointers (scm_ref_t).
+     */
+    if (!(scm->base = reserve(scm->reserve, scm->align)))
+    {
+        TRACE("mmap() failed");
+        release(scm);
+        return NULL;
+    }
+    registry_publish(scm);
+    /* settled by the first map(), which may well be in grow() */
+    scm->dax = (SCM_PERSIST_CACHELINE == scm->options.persist);
+    if ((scm->size && !scm->pool.on &&
+         map(scm,
+             0,
+             scm->size,
+             PROT_READ | PROT_WRITE,
+             (SCM_PREFAULT_POPULATE == scm->options.prefault) ? MAP_POPULATE : 0)) ||
+        ((scm->size < sizeof(struct header) + scm->page) &&
+         grow(scm, sizeof(struct header) + scm->page)))
+    {
+        TRACE("mmap() failed");
+        release(scm);
+        return NULL;
+    }
+    if (scm->size && !scm->pool.on)
+    {
+        advise(scm, 0, scm->size);
+    }
+
+    scm->header = (struct header *)scm->base;
+    if (truncate)
+    {
+        /* stale data would stay resident and on disk otherwise */
+        punch(scm, sizeof(struct header), scm->size);
+        memset(scm->header, 0, sizeof(struct header));
+        scm->header->magic = MAGIC;
+        scm->header->version = VERSION;
+        scm->header->page = scm->page;
+        scm->header->mode = scm->options.allocator;
+        scm->header->root = sizeof(struct header) + sizeof(size_t);
+        dirty(scm, scm->header, sizeof(struct header));
+    }
+    else if (superblock(scm))
+    {
+        release(scm);
+        return NULL;
+    }
+    else if (scm->header->moving)
+    {
+        /* the compaction copy is complete, finish moving it down */
+        relocate(scm);
+    }
+    else if (scm->header->compact)
+    {
+        /* the compaction copy is not, drop it */
+        __atomic_store_n(&scm->header->utilized, scm->header->compact - sizeof(struct header), __ATOMIC_RELEASE);
+        scm->header->compact = 0;
+        flush(scm, scm->header, sizeof(struct header));
+    }
+    else if (scm->header->used)
+    {
+        /* a transaction was interrupted, undo its partial updates */
+        rollback(scm);
+    }
+    scm->zero = zero_mark(scm, sizeof(struct header) + scm->header->utilized);
+    scm->opened = scm->header->stats;
+    if (scm->options.wal && wal_open(scm, pathname, truncate))
+    {
+        release(scm);
+        return NULL;
+    }
+    if (!scm->pool.on)
+    {
+        prefault(scm);
+    }
+
+    if (SCM_TRACK_WPROTECT == scm->options.tracking)
+    {
+        /* from here on, pages are writable only while dirty */
+        if (scm_persist_all(scm) || mprotect(scm->base, scm->size, PROT_READ))
+        {
+            TRACE("write-fault tracking unavailable");
+            release(scm);
+            return NULL;
+        }
+    }
+    else if (SCM_TRACK_SOFTDIRTY == scm->options.tracking)
+    {
+        /* start from a clean slate, as if the region was just checkpointed */
+        if (!soft_dirty_supported() || scm_persist_all(scm))
+        {
+            TRACE("soft-dirty tracking unavailable");
+            release(scm);
+            return NULL;
+        }
+    }
+
+    if (scm->options.flush_ms || scm->options.flush_bytes)
+    {
+        if (pthread_create(&scm->flusher, NULL, flusher, scm))
+        {
+            TRACE("pthread_create() failed");
+            release(scm);
+            return NULL;
+        }
+        scm->flushing = 1;
+    }
+    return scm;
+}
+
+/**
+ * Closes a previously opened SCM handle.
+ * Before closing, the dirty pages of the SCM region are synced to the disk.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * Note: scm may be NULL
+ */
+
+void scm_close(struct scm *scm)
+{
+    struct cache *cache;
+
+    if (scm)
+    {
+        scm_snapshot_wait(scm, NULL);
+        if (scm->flushing)
+        {
+            __atomic_store_n(&scm->stop, 1, __ATOMIC_RELEASE);
+            sem_post(&scm->wake);
+            pthread_join(scm->flusher, NULL);
+            scm->flushing = 0;
+        }
+
+        /* give back what the thread caches hold before syncing */
+        pthread_mutex_lock(&scm->lock);
+        for (cache = scm->caches; cache; cache = cache->next)
+        {
+            cache_drain(cache);
+        }
+        pthread_mutex_unlock(&scm->lock);
+
+        /* nothing is left to replay once everything is on disk */
+        if (!scm_persist_all(scm) && (0 <= scm->wal[0]) && (scm->applied + 1 == scm->next))
+        {
+            wal_truncate(scm, 0);
+            wal_truncate(scm, 1);
+        }
+
+        release(scm);
+    }
+
+    return;
+}
+
+/* scm_malloc(), *zero tells whether the block is known to be all zeros */
+
+static void *allocate(struct scm *scm, size_t n, int *zero)
+{
+    void *p;
+
+    if (scm->compacting)
+    {
+        p = compact_malloc(scm, n, zero);
+    }
+    else if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        pthread_mutex_lock(&scm->lock);
+        p = fit_malloc(scm, n, zero);
+        pthread_mutex_unlock(&scm->lock);
+    }
+    else
+    {
+        p = class_malloc(scm, n, zero);
+    }
+
+    /* new blocks need no undo, but must be durable at commit */
+    if (p)
+    {
+        dirty(scm, (size_t *)p - 1, n + sizeof(size_t));
+        if (scm->tx)
+        {
+            pend(scm, offset_of(scm, p) - sizeof(size_t), n + sizeof(size_t), 0);
+        }
+    }
+    return p;
+}
+
+/* resizes a block in place, see class_resize() and fit_resize() */
+
+static int resize(struct scm *scm, size_t *block, size_t n)
+{
+    int rc;
+
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        pthread_mutex_lock(&scm->lock);
+        rc = fit_resize(scm, block, n);
+        pthread_mutex_unlock(&scm->lock);
+    }
+    else
+    {
+        rc = class_resize(scm, block, n);
+    }
+    if (!rc)
+    {
+        /* the grown part is like a new block, durable at commit */
+        dirty(scm, block, n + sizeof(size_t));
+        if (scm->tx)
+        {
+            pend(scm, offset_of(scm, block), n + sizeof(size_t), 0);
+        }
+    }
+    return rc;
+}
+
+/* frees a block, see scm_free() */
+
+static void deallocate(struct scm *scm, size_t *block)
+{
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        pthread_mutex_lock(&scm->lock);
+        fit_free(scm, block);
+        pthread_mutex_unlock(&scm->lock);
+    }
+    else
+    {
+        class_free(scm, block);
+    }
+}
+
+/**
+ * Allocates n bytes at a multiple of align (a power of two), the word
+ * before the returned address then PADDED with the distance back to the
+ * payload if they differ, see block_of(). While compacting, the alignment
+ * is that of the final place, after the move. The first block allocated
+ * in an empty region is never padded, see scm_mbase().
+ *
+ * SCM_ALLOC_CLASS rounds the size for the next block carved right after
+ * to be aligned too: once a span or the bump tail is in step, blocks come
+ * aligned at no cost. Until then, or for a recycled block, the block is
+ * grown in place to make room for the padding, or swapped for a larger
+ * one. SCM_ALLOC_FIT payloads sit GRANULE bytes into 16-byte aligned
+ * blocks and are padded by align - GRANULE bytes in the steady state.
+ */
+
+static void *aligned(struct scm *scm, size_t n, size_t align, int *zero)
+{
+    size_t bias, gap;
+    int empty;
+    char *p;
+
+    if (align <= GRANULE)
+    {
+        return allocate(scm, n, zero);
+    }
+    if (n > SIZE_MAX - 2 * align)
+    {
+        return NULL;
+    }
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        n = (n + align - 1) / align * align + align - GRANULE;
+    }
+    else
+    {
+        n = (n + sizeof(size_t) + align - 1) / align * align - sizeof(size_t);
+    }
+    bias = scm->compacting ? (scm->header->compact - sizeof(struct header)) : 0;
+    empty = (bias == __atomic_load_n(&scm->header->utilized, __ATOMIC_RELAXED));
+    if (!(p = allocate(scm, n, zero)))
+    {
+        return NULL;
+    }
+    gap = (align - (offset_of(scm, p) - bias) % align) % align;
+
+    /* the first block of a region stays where scm_mbase() finds it */
+    if (!gap || empty)
+    {
+        return p;
+    }
+    if ((SCM_ALLOC_CLASS == scm->header->mode) && resize(scm, (size_t *)p - 1, n + gap))
+    {
+        deallocate(scm, (size_t *)p - 1);
+        if (!(p = allocate(scm, n + align - GRANULE, zero)))
+        {
+            return NULL;
+        }
+        gap = (align - (offset_of(scm, p) - bias) % align) % align;
+    }
+    if (gap)
+    {
+        ((size_t *)(p + gap))[-1] = gap | PADDED;
+    }
+    return p + gap;
+}
+
+/* returns the size word of the block holding payload p */
+
+static size_t *block_of(void *p)
+{
+    size_t *word;
+
+    word = (size_t *)p - 1;
+    if (*word & PADDED)
+    {
+        word = (size_t *)((char *)p - (*word & ~PADDED)) - 1;
+    }
+    return word;
+}
+
+/* payload bytes of a block, as scm_stats() counts them */
+
+static size_t payload(const struct scm *scm, const size_t *block)
+{
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        return (block[0] & ~(size_t)FIT_FLAGS) - sizeof(size_t);
+    }
+    return block[0];
+}
+
+/* an allocation by aligned(), counted for scm_stats() */
+
+static void *counted(struct scm *scm, void *p)
+{
+    if (p)
+    {
+        account(scm, payload(scm, block_of(p)), 0);
+    }
+    return p;
+}
+
+/**
+ * Analogous to the standard C malloc function, but using SCM region.
+ * Allocate memory for input word(size n). A free block of the matching
+ * size class (SCM_ALLOC_CLASS) or the best fitting free block, split if
+ * larger (SCM_ALLOC_FIT), is reused first; only then is the region bumped.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * n  : the size of the requested memory in bytes
+ *
+ * return: a pointer to the start of the allocated memory or NULL on error
+ */
+
+void *scm_malloc(struct scm *scm, size_t n)
+{
+    int zero;
+
+    if (!scm || n == 0)
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    return counted(scm, aligned(scm, n, scm->options.alignment, &zero));
+}
+
+/**
+ * Analogous to the standard C aligned_alloc function, but using SCM
+ * region. Alignments up to GRANULE cost nothing; larger ones waste up to
+ * align - GRANULE bytes at the start of the block.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * n    : the size of the requested memory in bytes
+ * align: the alignment, a power of two
+ *
+ * return: a pointer to the start of the allocated memory or NULL on error
+ */
+
+void *scm_aligned_alloc(struct scm *scm, size_t n, size_t align)
+{
+    int zero;
+
+    if (!scm || !n || !align || (align & (align - 1)))
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    align = (align < scm->options.alignment) ? scm->options.alignment : align;
+    return counted(scm, aligned(scm, n, align, &zero));
+}
+
+/**
+ * Allocates several objects as one block, each starting at a GRANULE
+ * boundary right after the previous one: a single size word, a single
+ * trip through the allocator and neighbours that share cache lines.
+ * The objects are released together by freeing the first one.
+ *
+ * scm    : an opaque handle previously obtained by calling scm_open()
+ * count  : the number of objects
+ * sizes  : the size of each object in bytes
+ * objects: receives the address of each object
+ *
+ * return: the block, which is objects[0], or NULL on error
+ */
+
+void *scm_malloc_multi(struct scm *scm, size_t count, const size_t *sizes, void **objects)
+{
+    size_t i, n, size;
+    char *p;
+
+    if (!scm || !count || !sizes || !objects)
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    for (n = i = 0; i < count; ++i)
+    {
+        size = (sizes[i] + GRANULE - 1) / GRANULE * GRANULE;
+        if ((size < sizes[i]) || (size > SIZE_MAX - n))
+        {
+            TRACE("invalid input");
+            return NULL;
+        }
+        n += size;
+    }
+    if (!n || !(p = scm_malloc(scm, n)))
+    {
+        return NULL;
+    }
+    for (n = i = 0; i < count; ++i)
+    {
+        objects[i] = p + n;
+        n += (sizes[i] + GRANULE - 1) / GRANULE * GRANULE;
+    }
+    return p;
+}
+
+/**
+ * Analogous to the standard C calloc function, but using SCM region.
+ * Memory the region knows to be zero is not written again: blocks bumped
+ * from a tail never used since the file was extended or punched, and the
+ * whole pages of a punched SCM_ALLOC_FIT block. This saves both the
+ * stores and the page dirtying.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * count: the number of elements
+ * size : the size of each element in bytes
+ *
+ * return: a pointer to the start of the zeroed memory or NULL on error
+ */
+
+void *scm_calloc(struct scm *scm, size_t count, size_t size)
+{
+    size_t *block;
+    size_t from, to, lo, hi;
+    char *p;
+    int zero;
+
+    if (!scm || !count || !size || (count > SIZE_MAX / size))
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    if (!(p = counted(scm, aligned(scm, count * size, scm->options.alignment, &zero))) || zero)
+    {
+        return p;
+    }
+    block = block_of(p);
+    from = offset_of(scm, p);
+    to = from + count * size;
+    if ((SCM_ALLOC_FIT == scm->header->mode) && (block[0] & FIT_PUNCHED))
+    {
+        /**
+         * Only the partial pages around the hole, see scm_punch(). The
+         * payload of an aligned block may start past the hole's first
+         * page, or even past its last one.
+         */
+        lo = offset_of(scm, block) + 3 * sizeof(size_t);
+        lo = (lo < from) ? from : lo;
+        lo = (lo + scm->page - 1) / scm->page * scm->page;
+        hi = (offset_of(scm, block) + (block[0] & ~(size_t)FIT_FLAGS) - sizeof(size_t)) / scm->page * scm->page;
+        hi = (hi < from) ? from : hi;
+        if ((from <= lo) && (lo < hi) && (lo < to))
+        {
+            memset(p, 0, lo - from);
+            if (hi < to)
+            {
+                memset((char *)scm->base + hi, 0, to - hi);
+            }
+            return p;
+        }
+    }
+    memset(p, 0, to - from);
+    return p;
+}
+
+/**
+ * Analogous to the standard C realloc function, but using SCM region.
+ * The block is resized in place whenever possible: when shrinking, when
+ * it ends at the bump tail (or at the current position of the calling
+ * thread's span), and in SCM_ALLOC_FIT mode, when the block above is
+ * free and large enough. Otherwise it is moved, keeping its alignment,
+ * and the old one freed.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : a previously allocated block, or NULL to allocate
+ * n  : the new size in bytes, 0 frees the block
+ *
+ * return: the resized block, p itself if it did not move, NULL on error
+ *         (p is then left untouched)
+ */
+
+void *scm_realloc(struct scm *scm, void *p, size_t n)
+{
+    size_t *block;
+    size_t old, gap, align, at;
+    void *q;
+    int zero;
+
+    if (!scm)
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+    if (!p)
+    {
+        return scm_malloc(scm, n);
+    }
+    if (!n)
+    {
+        scm_free(scm, p);
+        return NULL;
+    }
+
+    /* an aligned block keeps its padding */
+    block = block_of(p);
+    gap = (size_t)((char *)p - (char *)(block + 1));
+    if (n > SIZE_MAX - gap - FIT_MIN)
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        old = (block[0] & ~(size_t)FIT_FLAGS) - sizeof(size_t) - gap;
+    }
+    else
+    {
+        old = block[0] - gap;
+    }
+    if (!resize(scm, block, n + gap))
+    {
+        /* counted as a free and an allocation */
+        account(scm, old + gap, 1);
+        account(scm, payload(scm, block), 0);
+        return p;
+    }
+
+    /**
+     * A padded payload was aligned on purpose, perhaps past the configured
+     * alignment by scm_aligned_alloc(): the lowest set bit of its offset
+     * is at least what was asked for. The move keeps that, at the cost of
+     * some padding when the payload happened to land further aligned.
+     */
+    align = scm->options.alignment;
+    if (gap)
+    {
+        at = offset_of(scm, p);
+        if (scm->compacting && (at >= scm->header->compact))
+        {
+            /* the copy is aligned for its final place, see aligned() */
+            at -= scm->header->compact - sizeof(struct header);
+        }
+        align = ((at & (~at + 1)) > align) ? (at & (~at + 1)) : align;
+    }
+    if (!(q = counted(scm, aligned(scm, n, align, &zero))))
+    {
+        return NULL;
+    }
+    memcpy(q, p, (old < n) ? old : n);
+    scm_free(scm, p);
+    return q;
+}
+
+/**
+ * Analogous to the standard C strdup function, but using SCM region.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * s  : a C string to be duplicated.
+ *
+ * return: the base memory address of the duplicated C string or NULL on error
+ */
+
+char *scm_strdup(struct scm *scm, const char *s)
+{
+    char *pos = NULL;
+    size_t len;
+
+    if (!scm || !s)
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    /* plus a '\0' character to mark the end of the string */
+    len = safe_strlen(s) + 1;
+
+    if (!(pos = scm_malloc(scm, len)))
+    {
+        TRACE("scm_malloc() failed");
+        return NULL;
+    }
+
+    memcpy(pos, s, len);
+
+    return pos;
+}
+
+/**
+ * Analogous to the standard C free function, but using SCM region.
+ * The block is pushed on the free list of its size class for reuse by
+ * a later scm_malloc() of the same class, or, in SCM_ALLOC_FIT mode,
+ * coalesced with free neighbours and indexed by size.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : a pointer to the start of a previously allocated memory
+ */
+
+void scm_free(struct scm *scm, void *p)
+{
+    if (!scm || !p)
+    {
+        TRACE("invalid input");
+        return;
+    }
+
+    account(scm, payload(scm, block_of(p)), 1);
+    deallocate(scm, block_of(p));
+
+    return;
+}
+
+/**
+ * Allocates an object of a fixed size from a slab, without a size word:
+ * denser than scm_malloc() and, for sizes that divide 64, never across
+ * a cache line. Slabs with a free slot are kept on their pool's partial
+ * list, whose head is always used first.
+ *
+ * scm : an opaque handle previously obtained by calling scm_open()
+ * size: the size of the object in bytes, at most SLAB_MAX
+ *
+ * return: a pointer to the object or NULL on error
+ */
+
+void *scm_slab_alloc(struct scm *scm, size_t size)
+{
+    struct slab *slab;
+    size_t i, w, slots;
+    uint64_t bits;
+    char *p;
+
+    if (!scm || !size || (size > SLAB_MAX))
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+    size = (size + GRANULE - 1) / GRANULE * GRANULE;
+    size = (size < SLAB_MIN) ? SLAB_MIN : size;
+    slots = (SLAB - SLAB_HEAD) / size;
+
+    pthread_mutex_lock(&scm->lock);
+    if (POOLS == (i = pool_of(scm, size)))
+    {
+        pthread_mutex_unlock(&scm->lock);
+        TRACE("too many slab object sizes");
+        return NULL;
+    }
+
+    /* a compaction fills fresh slabs in order, see relocate() */
+    slab = NULL;
+    if (scm->compacting && scm->header->pools[i].fresh)
+    {
+        /* aligned for after the move, not rounded down from here */
+        slab = (struct slab *)((char *)scm->base + scm->header->pools[i].fresh);
+        slab = (slab->used < slots) ? slab : NULL;
+    }
+    else if (!scm->compacting)
+    {
+        /* a full slab has no business on the list, take it off */
+        while (scm->header->pools[i].partial &&
+               ((slab = slab_of(scm, scm->header->pools[i].partial))->used >= slots))
+        {
+            put(scm, &scm->header->pools[i].partial, slab->next);
+            put(scm, &slab->next, 0);
+            slab = NULL;
+        }
+    }
+    if (!slab)
+    {
+        if (!(slab = slab_new(scm, size)))
+        {
+            pthread_mutex_unlock(&scm->lock);
+            return NULL;
+        }
+        put(scm,
+            scm->compacting ? &scm->header->pools[i].fresh : &scm->header->pools[i].partial,
+            offset_of(scm, slab));
+    }
+
+    for (w = 0; (w < ARRAY_SIZE(slab->map)) && !~slab->map[w]; ++w)
+    {
+        /* full word */
+    }
+    bits = (w < ARRAY_SIZE(slab->map)) ? ~slab->map[w] : 0;
+    bits &= ~bits + 1;
+    if (!bits || (w * 64 + (size_t)__builtin_ctzl(bits) >= slots))
+    {
+        /* the map says full, whatever used says: past the end of the slab */
+        pthread_mutex_unlock(&scm->lock);
+        TRACE("slab map corrupted");
+        return NULL;
+    }
+    put(scm, &slab->map[w], slab->map[w] | bits);
+    put(scm, &slab->used, slab->used + 1);
+    p = (char *)slab - sizeof(size_t) + SLAB_HEAD + (w * 64 + (size_t)__builtin_ctzl(bits)) * size;
+
+    /* a full slab leaves the partial list, it is at its head */
+    if ((slab->used == slots) && !scm->compacting)
+    {
+        put(scm, &scm->header->pools[i].partial, slab->next);
+        put(scm, &slab->next, 0);
+    }
+    pthread_mutex_unlock(&scm->lock);
+    account(scm, size, 0);
+
+    /* new objects need no undo, but must be durable at commit */
+    dirty(scm, p, size);
+    if (scm->tx)
+    {
+        pend(scm, offset_of(scm, p), size, 0);
+    }
+    return p;
+}
+
+/**
+ * Releases an object obtained from scm_slab_alloc(); only its slot bit
+ * changes, and its slab goes back on the partial list if it was full.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : a pointer to the object
+ */
+
+void scm_slab_free(struct scm *scm, void *p)
+{
+    struct slab *slab;
+    size_t i, slot, slots;
+
+    if (!scm || !p)
+    {
+        TRACE("invalid input");
+        return;
+    }
+    slab = slab_of(scm, offset_of(scm, p));
+    slot = (size_t)((char *)p - (char *)slab + sizeof(size_t) - SLAB_HEAD) / slab->size;
+    slots = (SLAB - SLAB_HEAD) / slab->size;
+
+    pthread_mutex_lock(&scm->lock);
+    for (i = 0; (i < POOLS) && (scm->header->pools[i].size != slab->size); ++i)
+    {
+        /* search */
+    }
+    assert(POOLS > i);
+    if (slab->used == slots)
+    {
+        put(scm, &slab->next, scm->header->pools[i].partial);
+        put(scm, &scm->header->pools[i].partial, offset_of(scm, slab));
+    }
+    put(scm, &slab->map[slot / 64], slab->map[slot / 64] & ~((uint64_t)1 << (slot % 64)));
+    put(scm, &slab->used, slab->used - 1);
+    pthread_mutex_unlock(&scm->lock);
+    account(scm, slab->size, 1);
+}
+
+/**
+ * Creates an arena for objects that are all released together, see
+ * scm_arena_reset() and scm_arena_close(). Its chunks are taken from the
+ * region as needed, the first of chunk bytes. An arena is used by one
+ * thread at a time and must be closed before scm_compact_begin().
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * chunk: the size of the first chunk in bytes, 0 for 64 KiB
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct scm_arena *scm_arena_open(struct scm *scm, size_t chunk)
+{
+    struct scm_arena *arena;
+
+    if (!scm || (chunk > SIZE_MAX / 4))
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+    if (!(arena = malloc(sizeof(struct scm_arena))))
+    {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(arena, 0, sizeof(struct scm_arena));
+    arena->scm = scm;
+    arena->chunk = chunk ? (chunk + GRANULE - 1) / GRANULE * GRANULE : ARENA;
+    arena->align = (scm->options.alignment > GRANULE) ? scm->options.alignment : GRANULE;
+    return arena;
+}
+
+/**
+ * Allocates n bytes from an arena, aligned like scm_malloc() blocks. In
+ * the common case this is a bump of the current chunk; chunks kept by
+ * scm_arena_reset() are refilled before a new one is taken.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * n    : the size of the requested memory in bytes
+ *
+ * return: a pointer to the start of the allocated memory or NULL on error
+ */
+
+void *scm_arena_alloc(struct scm_arena *arena, size_t n)
+{
+    size_t pos, size;
+    char *p;
+
+    if (!arena || !n || (n > SIZE_MAX / 4))
+    {
+        TRACE("invalid input");
+        return NULL;
+    }
+
+    pos = arena->pos;
+    while (arena->cur < arena->count)
+    {
+        p = arena->base[arena->cur];
+        pos += (arena->align - (size_t)(p + pos) % arena->align) % arena->align;
+        if ((pos <= arena->size[arena->cur]) && (n <= arena->size[arena->cur] - pos))
+        {
+            arena->pos = pos + n;
+            return p + pos;
+        }
+        if (arena->cur + 1 == arena->count)
+        {
+            break;
+        }
+        arena->cur++;
+        pos = 0;
+    }
+    if (CHUNKS == arena->count)
+    {
+        TRACE("arena full");
+        return NULL;
+    }
+
+    /* the next chunk, twice the last one, with room to align n */
+    size = arena->count ? arena->size[arena->count - 1] : arena->chunk;
+    size = (arena->count && (size <= SIZE_MAX / 4)) ? 2 * size : size;
+    size = (size < n + arena->align) ? (n + arena->align) : size;
+    if (!(p = scm_malloc(arena->scm, size)))
+    {
+        return NULL;
+    }
+    arena->base[arena->count] = p;
+    arena->size[arena->count] = size;
+    arena->cur = arena->count++;
+    pos = (arena->align - (size_t)p % arena->align) % arena->align;
+    arena->pos = pos + n;
+    return p + pos;
+}
+
+/* returns the whole pages of every chunk to the file system */
+
+static void arena_punch(struct scm_arena *arena)
+{
+    size_t i, from;
+
+    for (i = 0; i < arena->count; ++i)
+    {
+        from = offset_of(arena->scm, arena->base[i]);
+        punch(arena->scm, from, from + arena->size[i]);
+    }
+}
+
+/**
+ * Releases every object of an arena at once, in O(1): the chunks are kept
+ * and refilled from the first. With punch, their pages are also returned
+ * to the file system, costing one call per chunk; they read as zero and
+ * come back on first touch.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * punch: non-zero to punch the pages of the chunks
+ */
+
+void scm_arena_reset(struct scm_arena *arena, int punch)
+{
+    if (!arena)
+    {
+        TRACE("invalid input");
+        return;
+    }
+
+    if (punch)
+    {
+        arena_punch(arena);
+    }
+    arena->cur = 0;
+    arena->pos = 0;
+}
+
+/**
+ * Releases every object of an arena and the arena itself, freeing its
+ * chunks: one per doubling of the arena's size.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * punch: non-zero to punch the pages of the chunks first
+ */
+
+void scm_arena_close(struct scm_arena *arena, int punch)
+{
+    size_t i;
+
+    if (!arena)
+    {
+        return;
+    }
+
+    if (punch)
+    {
+        arena_punch(arena);
+    }
+    for (i = 0; i < arena->count; ++i)
+    {
+        scm_free(arena->scm, arena->base[i]);
+    }
+    memset(arena, 0, sizeof(struct scm_arena));
+    free(arena);
+}
+
+/**
+ * Opens a transaction: until scm_commit(), the updates made through
+ * scm_log() and the allocator either all survive a crash or none does.
+ * Only the calling thread may use the region while it is open.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 if a transaction is already open
+ */
+
+int scm_begin(struct scm *scm)
+{
+    struct cache *cache;
+
+    assert(scm);
+
+    if (SCM_ATOMIC_NONE == scm->options.atomicity)
+    {
+        return 0;
+    }
+    if (scm->tx)
+    {
+        TRACE("transaction already open");
+        return -1;
+    }
+    /* the thread cache is volatile, keep a copy in case of scm_abort() */
+    if ((cache = pthread_getspecific(scm->key)))
+    {
+        scm->saved = *cache;
+    }
+    scm->pending = 0;
+    scm->tx = 1;
+    return 0;
+}
+
+/**
+ * Declares that the n bytes at p are about to be modified by the open
+ * transaction, saving their current content in the undo log. Without an
+ * open transaction only their pages are marked for scm_persist_all().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : the start of the range, inside the SCM region
+ * n  : the length of the range in bytes
+ */
+
+void scm_log(struct scm *scm, const void *p, size_t n)
+{
+    assert(scm);
+
+    undo(scm, p, n);
+    dirty(scm, p, n);
+}
+
+/**
+ * Commits the open transaction. In SCM_ATOMIC_SYNC mode, the pages it
+ * touched are written back first, each once, and the log is cleared
+ * only after.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_commit(struct scm *scm)
+{
+    int rc;
+
+    assert(scm);
+
+    if (!scm->tx)
+    {
+        return 0;
+    }
+    rc = 0;
+    if (SCM_ATOMIC_SYNC == scm->options.atomicity)
+    {
+        flush_pending(scm);
+        __atomic_store_n(&scm->header->used, 0, __ATOMIC_RELEASE);
+        rc = persist(scm, &scm->header->used, sizeof(size_t));
+    }
+    else
+    {
+        __atomic_store_n(&scm->header->used, 0, __ATOMIC_RELEASE);
+        dirty(scm, &scm->header->used, sizeof(size_t));
+    }
+    if (scm->appended)
+    {
+        /* the undo log is clear, a checkpoint from now on sees it all */
+        pthread_mutex_lock(&scm->logging);
+        scm->applied = scm->appended;
+        pthread_mutex_unlock(&scm->logging);
+        scm->appended = 0;
+    }
+    scm->tx = 0;
+    return rc;
+}
+
+/**
+ * Rolls the open transaction back, restoring every byte it modified.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ */
+
+void scm_abort(struct scm *scm)
+{
+    struct cache *cache;
+
+    assert(scm);
+
+    if (!scm->tx)
+    {
+        return;
+    }
+    scm->tx = 0;
+    scm->appended = 0;
+    rollback(scm);
+    if ((cache = pthread_getspecific(scm->key)))
+    {
+        *cache = scm->saved;
+    }
+}
+
+/**
+ * Synchronously writes back the pages covering the n bytes at p, and
+ * only those. Use it to make an update durable without a transaction,
+ * or to persist memory written without scm_log().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : the start of the range, inside the SCM region
+ * n  : the length of the range in bytes
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_persist(struct scm *scm, const void *p, size_t n)
+{
+    assert(scm);
+
+    if (((const char *)p < (const char *)scm->base) ||
+        (offset_of(scm, p) + n > __atomic_load_n(&scm->size, __ATOMIC_ACQUIRE)))
+    {
+        TRACE("invalid input");
+        return -1;
+    }
+    return n ? persist(scm, p, n) : 0;
+}
+
+/**
+ * Synchronously writes back every page modified since it was last
+ * persisted, as found by scm_options.tracking.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_persist_all(struct scm *scm)
+{
+    return scm_checkpoint(scm, NULL);
+}
+
+/**
+ * Writes back the dirty pages, one msync() per run of adjacent ones. The
+ * bitmap is consumed a word at a time, so only the words of the mapped
+ * file are scanned and a clean word costs a single exchange.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: if not NULL, receives the page count and timings
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_checkpoint(struct scm *scm, struct scm_checkpoint *stats)
+{
+    struct scm_checkpoint local;
+    size_t i, n, word, page, from, to, last, applied;
+    double t;
+    int rc, old;
+
+    assert(scm);
+
+    stats = stats ? stats : &local;
+    memset(stats, 0, sizeof(struct scm_checkpoint));
+    rc = 0;
+    t = now();
+    last = applied = 0;
+    old = (0 <= scm->wal[0]) ? wal_rotate(scm, &last, &applied) : 0;
+    pthread_mutex_lock(&scm->lock);
+    tally(scm, &scm->header->stats);
+    pthread_mutex_unlock(&scm->lock);
+    dirty(scm, &scm->header->stats, sizeof(struct scm_stats));
+    if ((SCM_TRACK_SOFTDIRTY == scm->options.tracking) && soft_dirty_collect())
+    {
+        rc = -1;
+    }
+    stats->collect = now() - t;
+
+    t = now();
+    from = to = 0;
+    n = (__atomic_load_n(&scm->size, __ATOMIC_ACQUIRE) + 64 * scm->page - 1) / (64 * scm->page);
+    for (i = 0; i <= n; ++i)
+    {
+        /* one extra round past the end flushes the last run */
+        word = (i < n) ? __atomic_exchange_n(&scm->dirty[i], 0, __ATOMIC_ACQ_REL) : 1;
+        if (i < n)
+        {
+            __atomic_fetch_sub(&scm->dirtied, (size_t)__builtin_popcountl(word), __ATOMIC_RELAXED);
+        }
+        while (word)
+        {
+            page = (i < n) ? (i * 64 + (size_t)__builtin_ctzl(word)) : SIZE_MAX;
+            word &= word - 1;
+            if (page != to)
+            {
+                if (from < to)
+                {
+                    rc = flush(scm, (char *)scm->base + from * scm->page, (to - from) * scm->page) ? -1 : rc;
+                    stats->pages += to - from;
+                    stats->runs++;
+                }
+                from = page;
+            }
+            to = page + 1;
+        }
+    }
+    stats->sync = now() - t;
+    if (!rc && (0 <= scm->wal[0]))
+    {
+        wal_trim(scm, old, last, applied);
+    }
+    return rc;
+}
+
+/**
+ * Waits until everything written to the region before the call is
+ * durable. With a flusher thread (scm_options.flush_ms or flush_bytes),
+ * concurrent callers share one checkpoint; without one, the calling
+ * thread runs the checkpoint itself.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_barrier(struct scm *scm)
+{
+    size_t ticket;
+    int rc;
+
+    assert(scm);
+
+    if (!scm->flushing)
+    {
+        return scm_persist_all(scm);
+    }
+    pthread_mutex_lock(&scm->barrier);
+    /* a checkpoint already under way may have missed our writes */
+    ticket = scm->started + 1;
+    sem_post(&scm->wake);
+    while (scm->completed < ticket)
+    {
+        pthread_cond_wait(&scm->flushed, &scm->barrier);
+    }
+    rc = scm->failed;
+    pthread_mutex_unlock(&scm->barrier);
+    return rc;
+}
+
+/**
+ * The snapshot thread: copies, extent by extent, the pages no write has
+ * claimed, waits for those being copied by writers, then lets the region
+ * be written freely again.
+ */
+
+static void *snapper(void *arg)
+{
+    struct scm *scm;
+    size_t i, n, bit;
+    off_t data, hole;
+
+    scm = (struct scm *)arg;
+    n = (scm->snap.size + scm->page - 1) / scm->page;
+    for (hole = 0; (data = lseek(scm->fd, hole, SEEK_DATA)) >= 0; )
+    {
+        /* holes read as zeros, and the copy was created sparse */
+        if ((hole = lseek(scm->fd, data, SEEK_HOLE)) < 0)
+        {
+            hole = (off_t)scm->snap.size;
+        }
+        for (i = (size_t)data / scm->page; (i < n) && (i * scm->page < (size_t)hole); ++i)
+        {
+            bit = (size_t)1 << (i % 64);
+            if (!(__atomic_fetch_or(&scm->snap.claimed[i / 64], bit, __ATOMIC_ACQ_REL) & bit))
+            {
+                scm->snap.failed |= snap_copy(scm, i);
+                __atomic_fetch_or(&scm->snap.done[i / 64], bit, __ATOMIC_ACQ_REL);
+            }
+        }
+        if ((size_t)hole >= scm->snap.size)
+        {
+            break;
+        }
+    }
+    for (i = 0; i < (n + 63) / 64; ++i)
+    {
+        while (__atomic_load_n(&scm->snap.claimed[i], __ATOMIC_ACQUIRE) !=
+               __atomic_load_n(&scm->snap.done[i], __ATOMIC_ACQUIRE))
+        {
+            sched_yield();
+        }
+    }
+    if (fdatasync(scm->snap.fd))
+    {
+        scm->snap.failed = 1;
+    }
+
+    /* writable again before fault() stops recognizing the pages */
+    if (SCM_TRACK_WPROTECT != scm->options.tracking)
+    {
+        mprotect(scm->base, scm->snap.size, PROT_READ | PROT_WRITE);
+    }
+    __atomic_store_n(&scm->snapping, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&scm->faulting, __ATOMIC_SEQ_CST))
+    {
+        sched_yield();
+    }
+    scm->snap.stats.elapsed = now() - scm->snap.start;
+    return NULL;
+}
+
+/**
+ * Writes a point-in-time copy of the region to pathname, as it is when
+ * called, which must be between transactions. Where the file system
+ * shares extents (FICLONE: btrfs, XFS, ...), the copy is a reflink made
+ * on the spot. Otherwise the region is write-protected and a thread
+ * copies it while the caller goes on: a page about to be written is
+ * copied first, by the writing thread. Only one snapshot of a region is
+ * copied at a time, and the region is neither punched nor compacted
+ * meanwhile. A buffer pool writes its frames back, then takes a reflink
+ * or fails.
+ *
+ * scm     : an opaque handle previously obtained by calling scm_open()
+ * pathname: the copy, created or truncated
+ * stats   : if not NULL, receives whether it was a reflink and the pause
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_snapshot(struct scm *scm, const char *pathname, struct scm_snapshot *stats)
+{
+    size_t words;
+
+    assert(scm && pathname);
+
+    if (scm->tx || scm->compacting || scm->snap.running)
+    {
+        TRACE("transaction, compaction or snapshot open");
+        return -1;
+    }
+    /* a buffer pool has the region to write back first */
+    if (scm->pool.on && scm_checkpoint(scm, NULL))
+    {
+        return -1;
+    }
+    memset(&scm->snap.stats, 0, sizeof(struct scm_snapshot));
+    scm->snap.start = now();
+    if (0 > (scm->snap.fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)))
+    {
+        TRACE("open file failed");
+        return -1;
+    }
+    scm->snap.size = __atomic_load_n(&scm->size, __ATOMIC_ACQUIRE);
+    scm->snap.stats.size = scm->snap.size;
+    if (!ioctl(scm->snap.fd, FICLONE, scm->fd))
+    {
+        close(scm->snap.fd);
+        scm->snap.stats.cloned = 1;
+        scm->snap.stats.pause = scm->snap.stats.elapsed = now() - scm->snap.start;
+        if (stats)
+        {
+            *stats = scm->snap.stats;
+        }
+        return 0;
+    }
+    if (scm->pool.on)
+    {
+        TRACE("no reflink, and copy-before-write needs SCM_BACKEND_MMAP");
+        close(scm->snap.fd);
+        return -1;
+    }
+
+    words = (scm->snap.size / scm->page + 64) / 64;
+    scm->snap.claimed = calloc(words, sizeof(size_t));
+    scm->snap.done = calloc(words, sizeof(size_t));
+    scm->snap.failed = 0;
+    if (!scm->snap.claimed || !scm->snap.done || trap() ||
+        ftruncate(scm->snap.fd, (off_t)scm->snap.size))
+    {
+        TRACE("cannot start the snapshot");
+        free(scm->snap.claimed);
+        free(scm->snap.done);
+        close(scm->snap.fd);
+        return -1;
+    }
+    __atomic_store_n(&scm->snapping, 1, __ATOMIC_SEQ_CST);
+    if (mprotect(scm->base, scm->snap.size, PROT_READ) ||
+        pthread_create(&scm->snap.thread, NULL, snapper, scm))
+    {
+        TRACE("cannot start the snapshot");
+        if (SCM_TRACK_WPROTECT != scm->options.tracking)
+        {
+            mprotect(scm->base, scm->snap.size, PROT_READ | PROT_WRITE);
+        }
+        __atomic_store_n(&scm->snapping, 0, __ATOMIC_SEQ_CST);
+        free(scm->snap.claimed);
+        free(scm->snap.done);
+        close(scm->snap.fd);
+        return -1;
+    }
+    scm->snap.running = 1;
+    scm->snap.stats.pause = now() - scm->snap.start;
+    if (stats)
+    {
+        *stats = scm->snap.stats;
+    }
+    return 0;
+}
+
+/**
+ * Waits until the copy started by scm_snapshot() is complete and durable.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: if not NULL, receives the pause, the copy time and the bytes
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_snapshot_wait(struct scm *scm, struct scm_snapshot *stats)
+{
+    int rc;
+
+    assert(scm);
+
+    rc = 0;
+    if (scm->snap.running)
+    {
+        pthread_join(scm->snap.thread, NULL);
+        scm->snap.running = 0;
+        free(scm->snap.claimed);
+        free(scm->snap.done);
+        scm->snap.claimed = scm->snap.done = NULL;
+        rc = (close(scm->snap.fd) || scm->snap.failed) ? -1 : 0;
+    }
+    if (stats)
+    {
+        *stats = scm->snap.stats;
+    }
+    return rc;
+}
+
+/* tells whether the n bytes at p are all zero */
+
+static int zeros(const char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; (i + sizeof(size_t) <= n) && !*(const size_t *)(p + i); i += sizeof(size_t))
+    {
+        /* a word at a time, p is page aligned */
+    }
+    for (; (i < n) && !p[i]; ++i)
+    {
+        /* the tail of a file not a multiple of words */
+    }
+    return i == n;
+}
+
+/**
+ * Writes the n bytes at p to fd at offset, skipping the pages that are
+ * all zero so that they stay holes, one pwrite() per run of the others.
+ */
+
+static int write_sparse(int fd, const char *p, size_t offset, size_t n, size_t page, size_t *bytes)
+{
+    size_t i, j, k;
+    ssize_t m;
+
+    for (i = 0; i < n; i = j)
+    {
+        j = (n - i < page) ? n : (i + page);
+        if (zeros(p + i, j - i))
+        {
+            continue;
+        }
+        while ((j < n) && !zeros(p + j, (n - j < page) ? (n - j) : page))
+        {
+            j = (n - j < page) ? n : (j + page);
+        }
+        for (k = i; k < j; k += (size_t)m)
+        {
+            if (0 >= (m = pwrite(fd, p + k, j - k, (off_t)(offset + k))))
+            {
+                TRACE("pwrite() failed");
+                return -1;
+            }
+        }
+        *bytes += j - i;
+    }
+    return 0;
+}
+
+/* marks in mask the whole pages of [from, to) below end, returns their bytes */
+
+static size_t mark(const struct scm *scm, size_t *mask, size_t from, size_t to, size_t end)
+{
+    size_t i;
+
+    from = (from + scm->page - 1) / scm->page;
+    to = ((to < end) ? to : end) / scm->page;
+    for (i = from; i < to; ++i)
+    {
+        mask[i / 64] |= (size_t)1 << (i % 64);
+    }
+    return (from < to) ? (to - from) * scm->page : 0;
+}
+
+/* copies [offset, offset + n) of file src to dst through buf, holes kept */
+
+static int copy_range(int src, int dst, size_t offset, size_t n, size_t page, char *buf, size_t *bytes)
+{
+    size_t m;
+
+    for (; n; offset += m, n -= m)
+    {
+        m = (n < COPY) ? n : COPY;
+        if ((ssize_t)m != pread(src, buf, m, (off_t)offset))
+        {
+            TRACE("pread() failed");
+            return -1;
+        }
+        if (write_sparse(dst, buf, offset, m, page, bytes))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Marks in mask the pages below end that lie wholly inside a free block,
+ * leaving out the words the allocator keeps there as scm_punch() does,
+ * and returns their bytes. scm->lock held.
+ */
+
+static size_t free_pages(const struct scm *scm, size_t *mask, size_t end)
+{
+    size_t b, next, bytes;
+    size_t *block;
+
+    bytes = 0;
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        /* the tag, both links and the footer */
+        for (b = bin_of(scm->page); b < BINS; ++b)
+        {
+            for (next = scm->header->bins[b]; next; next = block[1])
+            {
+                block = block_at(scm, next);
+                bytes += mark(scm,
+                              mask,
+                              next + 3 * sizeof(size_t),
+                              next + (block[0] & ~(size_t)FIT_FLAGS) - sizeof(size_t),
+                              end);
+            }
+        }
+    }
+    else
+    {
+        /* the size and the link */
+        for (next = scm->header->free[LARGE]; next; next = block[1])
+        {
+            block = block_at(scm, next);
+            bytes += mark(scm, mask, next + 2 * sizeof(size_t), next + sizeof(size_t) + block[0], end);
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Writes the header and the utilized data of the region to pathname, in
+ * the calling thread: pages inside free blocks, all-zero pages and holes
+ * of the backing file are left as holes of the copy, and nothing past
+ * the utilized data is written at all. Blocks held by thread caches go
+ * in as in use, as after a crash. The region must be between
+ * transactions and not written by other threads meanwhile. A buffer
+ * pool writes its frames back and the copy is read from the file.
+ *
+ * scm     : an opaque handle previously obtained by calling scm_open()
+ * pathname: the copy, created or truncated
+ * stats   : if not NULL, receives its size and the bytes written
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_export(struct scm *scm, const char *pathname, struct scm_export *stats)
+{
+    struct scm_export local;
+    size_t end, i, j, to, *mask;
+    off_t data, hole;
+    char *buf;
+    double t;
+    int fd, rc;
+
+    assert(scm && pathname);
+
+    stats = stats ? stats : &local;
+    memset(stats, 0, sizeof(struct scm_export));
+    t = now();
+    if (scm->tx || scm->compacting)
+    {
+        TRACE("transaction or compaction open");
+        return -1;
+    }
+    buf = NULL;
+    if (scm->pool.on && (scm_checkpoint(scm, NULL) || !(buf = malloc(COPY))))
+    {
+        TRACE("cannot write back the buffer pool");
+        free(buf);
+        return -1;
+    }
+    if (0 > (fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)))
+    {
+        TRACE("open file failed");
+        free(buf);
+        return -1;
+    }
+    pthread_mutex_lock(&scm->lock);
+    tally(scm, &scm->header->stats);
+    end = (sizeof(struct header) + scm->header->utilized + scm->page - 1) / scm->page * scm->page;
+    end = (end < scm->size) ? end : scm->size;
+    if (!(mask = calloc(end / scm->page / 64 + 1, sizeof(size_t))))
+    {
+        pthread_mutex_unlock(&scm->lock);
+        TRACE("out of memory");
+        close(fd);
+        free(buf);
+        return -1;
+    }
+    stats->free = free_pages(scm, mask, end);
+    pthread_mutex_unlock(&scm->lock);
+    dirty(scm, &scm->header->stats, sizeof(struct scm_stats));
+
+    rc = ftruncate(fd, (off_t)end) ? -1 : 0;
+    for (hole = 0; !rc && ((size_t)hole < end) && (0 <= (data = lseek(scm->fd, hole, SEEK_DATA))); )
+    {
+        /* holes of the backing file are not even read */
+        if ((0 > (hole = lseek(scm->fd, data, SEEK_HOLE))) || ((size_t)hole > end))
+        {
+            hole = (off_t)end;
+        }
+        for (i = (size_t)data / scm->page; !rc && (i * scm->page < (size_t)hole); i = j)
+        {
+            j = i + 1;
+            if (mask[i / 64] & ((size_t)1 << (i % 64)))
+            {
+                continue;
+            }
+            while ((j * scm->page < (size_t)hole) && !(mask[j / 64] & ((size_t)1 << (j % 64))))
+            {
+                ++j;
+            }
+            to = (j * scm->page < (size_t)hole) ? (j * scm->page) : (size_t)hole;
+            if (buf)
+            {
+                rc = copy_range(scm->fd, fd, i * scm->page, to - i * scm->page, scm->page, buf, &stats->bytes);
+                continue;
+            }
+            rc = write_sparse(fd,
+                              (const char *)scm->base + i * scm->page,
+                              i * scm->page,
+                              to - i * scm->page,
+                              scm->page,
+                              &stats->bytes);
+        }
+    }
+    free(mask);
+    free(buf);
+    if (rc || fdatasync(fd))
+    {
+        TRACE("cannot write the export");
+        rc = -1;
+    }
+    rc = close(fd) ? -1 : rc;
+    stats->size = end;
+    stats->elapsed = now() - t;
+    return rc;
+}
+
+/* copies the data extents of [0, end) from src to dst, see scm_import() */
+
+static int import_copy(int src, int dst, size_t end, size_t page, size_t *bytes)
+{
+    off_t data, hole;
+    size_t from;
+    char *buf;
+    int rc;
+
+    if (!(buf = malloc(COPY)))
+    {
+        TRACE("out of memory");
+        return -1;
+    }
+    rc = 0;
+    for (hole = 0; !rc && ((size_t)hole < end) && (0 <= (data = lseek(src, hole, SEEK_DATA))); )
+    {
+        if ((0 > (hole = lseek(src, data, SEEK_HOLE))) || ((size_t)hole > end))
+        {
+            hole = (off_t)end;
+        }
+        from = (size_t)data / page * page;
+        rc = copy_range(src, dst, from, (size_t)hole - from, page, buf, bytes);
+    }
+    free(buf);
+    return rc;
+}
+
+/**
+ * Restores a region written by scm_export(), or copied any other way, to
+ * pathname: only the header and the utilized data are copied, and the
+ * file is then sized to size bytes, or left at its former size (if
+ * larger) when size is 0, the rest of it a hole. scm_open() takes the
+ * result like any region.
+ *
+ * from    : the export
+ * pathname: the region, created if need be, not open
+ * size    : its size in bytes, at least the header and the utilized data
+ * stats   : if not NULL, receives its size and the bytes written
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_import(const char *from, const char *pathname, size_t size, struct scm_export *stats)
+{
+    struct scm_export local;
+    struct header *header;
+    struct stat info;
+    size_t end, page;
+    double t;
+    int src, dst, rc;
+
+    assert(from && pathname);
+
+    stats = stats ? stats : &local;
+    memset(stats, 0, sizeof(struct scm_export));
+    t = now();
+    if (0 > (src = open(from, O_RDONLY)))
+    {
+        TRACE("open file failed");
+        return -1;
+    }
+    if (fstat(src, &info) || !(header = malloc(sizeof(struct header))))
+    {
+        TRACE("cannot read the export");
+        close(src);
+        return -1;
+    }
+    if ((sizeof(struct header) != pread(src, header, sizeof(struct header), 0)) ||
+        (MAGIC != header->magic) ||
+        (VERSION != header->version) ||
+        !header->page ||
+        (header->page & (header->page - 1)) ||
+        (header->utilized > (size_t)info.st_size - sizeof(struct header)))
+    {
+        TRACE("not an SCM region");
+        free(header);
+        close(src);
+        return -1;
+    }
+    page = header->page;
+    end = (sizeof(struct header) + header->utilized + page - 1) / page * page;
+    end = (end < (size_t)info.st_size) ? end : (size_t)info.st_size;
+    free(header);
+    if (size && (size < end))
+    {
+        TRACE("file too small");
+        close(src);
+        return -1;
+    }
+
+    /* two handles on one file would keep diverging allocator state */
+    if ((0 > (dst = open(pathname, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR))) ||
+        flock(dst, LOCK_EX | LOCK_NB) ||
+        fstat(dst, &info))
+    {
+        TRACE("cannot open the region, or it is open");
+        if (0 <= dst)
+        {
+            close(dst);
+        }
+        close(src);
+        return -1;
+    }
+    if (!size)
+    {
+        size = ((size_t)info.st_size > end) ? (size_t)info.st_size : end;
+    }
+    /* whatever the file held before goes, the rest of it is a hole */
+    rc = (ftruncate(dst, 0) ||
+          ftruncate(dst, (off_t)size) ||
+          import_copy(src, dst, end, page, &stats->bytes) ||
+          fdatasync(dst))
+             ? -1
+             : 0;
+    if (rc)
+    {
+        TRACE("cannot write the region");
+    }
+    rc = close(dst) ? -1 : rc;
+    close(src);
+    stats->size = size;
+    stats->elapsed = now() - t;
+    return rc;
+}
+
+/**
+ * Appends a record to the write-ahead log of scm_options.wal, as the last
+ * step of the open transaction: the region notes its number along with
+ * the transaction, and scm_wal_replay() applies it again after a crash
+ * unless a checkpoint got there first. A transaction aborted after this
+ * is replayed all the same. Without a log, nothing is written and *lsn
+ * is 0.
+ *
+ * scm : an opaque handle previously obtained by calling scm_open()
+ * type: what the record is, passed back on replay
+ * p   : the record
+ * n   : its length in bytes
+ * lsn : receives its sequence number, to pass to scm_wal_sync()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_wal_append(struct scm *scm, int type, const void *p, size_t n, size_t *lsn)
+{
+    struct record record;
+    struct iovec iov[2];
+
+    assert(scm && lsn);
+
+    *lsn = 0;
+    if (0 > scm->wal[0])
+    {
+        return 0;
+    }
+    if (n > UINT32_MAX)
+    {
+        TRACE("invalid input");
+        return -1;
+    }
+    if (scm->replay)
+    {
+        /* the record is in the log already */
+        put(scm, &scm->header->lsn, scm->replay);
+        scm->appended = scm->tx ? scm->replay : 0;
+        return 0;
+    }
+
+    pthread_mutex_lock(&scm->logging);
+    record.lsn = scm->next;
+    record.type = (uint32_t)type;
+    record.n = (uint32_t)n;
+    record.sum = record_sum(&record, p);
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(struct record);
+    iov[1].iov_base = (void *)p;
+    iov[1].iov_len = n;
+    if ((ssize_t)(sizeof(struct record) + n) != writev(scm->wal[scm->cur], iov, 2))
+    {
+        pthread_mutex_unlock(&scm->logging);
+        TRACE("writev() failed");
+        return -1;
+    }
+    *lsn = scm->next++;
+    scm->last[scm->cur] = *lsn;
+    scm->unsynced[scm->cur] = 1;
+    put(scm, &scm->header->lsn, *lsn);
+    if (scm->tx)
+    {
+        scm->appended = *lsn;
+    }
+    else
+    {
+        scm->applied = *lsn;
+    }
+    pthread_mutex_unlock(&scm->logging);
+    return 0;
+}
+
+/**
+ * Waits until the log is durable up to record lsn. Callers arriving while
+ * an fdatasync() is under way wait for the next one, which then covers
+ * them all: one sync per batch of concurrent operations.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * lsn: a number from scm_wal_append(), 0 returns at once
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_wal_sync(struct scm *scm, size_t lsn)
+{
+    size_t target;
+    int unsynced[2];
+    int rc;
+
+    assert(scm);
+
+    rc = 0;
+    pthread_mutex_lock(&scm->logging);
+    while (!rc && (scm->synced < lsn))
+    {
+        if (scm->syncing)
+        {
+            pthread_cond_wait(&scm->logged, &scm->logging);
+            continue;
+        }
+        scm->syncing = 1;
+        target = scm->next - 1;
+        unsynced[0] = scm->unsynced[0];
+        unsynced[1] = scm->unsynced[1];
+        scm->unsynced[0] = scm->unsynced[1] = 0;
+        pthread_mutex_unlock(&scm->logging);
+        if ((unsynced[0] && fdatasync(scm->wal[0])) || (unsynced[1] && fdatasync(scm->wal[1])))
+        {
+            TRACE("fdatasync() failed");
+            rc = -1;
+        }
+        pthread_mutex_lock(&scm->logging);
+        if (rc)
+        {
+            scm->unsynced[0] |= unsynced[0];
+            scm->unsynced[1] |= unsynced[1];
+        }
+        else
+        {
+            scm->synced = (target > scm->synced) ? target : scm->synced;
+        }
+        scm->syncing = 0;
+        pthread_cond_broadcast(&scm->logged);
+    }
+    pthread_mutex_unlock(&scm->logging);
+    return rc;
+}
+
+/**
+ * Applies again the log records that the region does not reflect, oldest
+ * first, each through fnc, which is expected to redo its transaction and
+ * call scm_wal_append() as it did the first time. The log is emptied
+ * once the region is durable. Call it right after scm_open(), before any
+ * other transaction.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * fnc: redoes one record
+ * arg: passed to fnc
+ *
+ * return: 0 on success, -1 on error or if fnc failed
+ */
+
+int scm_wal_replay(struct scm *scm, scm_wal_fnc_t fnc, void *arg)
+{
+    int first;
+
+    assert(scm && fnc);
+
+    if (0 > scm->wal[0])
+    {
+        return 0;
+    }
+    first = (scm->last[1] && (!scm->last[0] || (scm->last[1] < scm->last[0]))) ? 1 : 0;
+    if (wal_read(scm, first, fnc, arg) || wal_read(scm, 1 - first, fnc, arg))
+    {
+        return -1;
+    }
+    scm->applied = scm->header->lsn;
+    if (scm_persist_all(scm))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&scm->logging);
+    if (scm->applied + 1 == scm->next)
+    {
+        wal_truncate(scm, 0);
+        wal_truncate(scm, 1);
+    }
+    pthread_mutex_unlock(&scm->logging);
+    return 0;
+}
 
 /**
- * Initializes an SCM region using the file specified in pathname as the
- * backing device, opening the regsion for memory allocation activities.
+ * Starts compacting the region. Until scm_compact_commit(), scm_malloc()
+ * places blocks back to back past everything allocated so far, in call
+ * order, and nothing may be freed. The caller copies what is live into
+ * such blocks, the block meant to be found by scm_mbase() first, storing
+ * every reference as SCM_REF() minus *shift: the place it will have once
+ * the copy is moved down to the start of the data area.
  *
- * pathname: the file pathname of the backing device
- * truncate: if non-zero, truncates the SCM region, clearning all data
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * shift: receives how far the new blocks will move
  *
- * return: an opaque handle or NULL on error
+ * return: 0 on success, -1 on error
  */
 
-struct scm *scm_open(const char *pathname, int truncate)
+int scm_compact_begin(struct scm *scm, size_t *shift)
 {
-    struct scm *scm;
-    struct stat info;
+    size_t i;
 
-    int fd;
+    assert(scm);
+    assert(shift);
 
-    if ((fd = open(pathname, O_RDWR, S_IRUSR | S_IWUSR)) < 0)
+    if (scm->tx || scm->compacting || scm->snap.running)
     {
-        TRACE("open file failed");
-        return NULL;
+        TRACE("transaction, compaction or snapshot open");
+        return -1;
     }
-    if (fstat(fd, &info))
+    /* fresh blocks from here on, none from the thread caches */
+    pthread_mutex_lock(&scm->lock);
+    for (i = 0; i < POOLS; ++i)
     {
-        TRACE("fstat() failed");
-        return NULL;
+        scm->header->pools[i].fresh = 0;
     }
-    if (!S_ISREG(info.st_mode))
+    scm->header->compact = sizeof(struct header) + scm->header->utilized;
+    pthread_mutex_unlock(&scm->lock);
+    if (flush(scm, &scm->header->compact, sizeof(size_t)))
     {
-        TRACE("not a regular file");
-        return NULL;
+        scm->header->compact = 0;
+        return -1;
     }
+    scm->compacting = 1;
+    *shift = scm->header->compact - sizeof(struct header);
+    return 0;
+}
 
-    if (!(scm = malloc(sizeof(struct scm))))
+/**
+ * Replaces the content of the region with the blocks allocated since
+ * scm_compact_begin(). The blocks are made durable, moved down to the
+ * start of the data area, and every earlier block, free or not, is
+ * dropped; the pages past the new end are punched. A crash at any point
+ * leaves either the old content or the new one.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error (the compaction is then aborted)
+ */
+
+int scm_compact_commit(struct scm *scm)
+{
+    struct scm_stats stats;
+    struct cache *cache;
+    size_t n;
+
+    assert(scm);
+
+    if (!scm->compacting)
     {
-        TRACE("out of memory");
-        close(fd);
-        return NULL;
+        return -1;
     }
+    n = sizeof(struct header) + scm->header->utilized - scm->header->compact;
 
-    scm->base = mmap((void *)VIRT_ADDR, info.st_size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, fd, 0);
-    if (scm->base == MAP_FAILED)
+    /* every earlier block is dropped, the copies take their place */
+    pthread_mutex_lock(&scm->lock);
+    tally(scm, &stats);
+    pthread_mutex_unlock(&scm->lock);
+    stats.frees += stats.allocs - stats.frees;
+    stats.allocs += scm->copied.allocs;
+    stats.frees += scm->copied.frees;
+    memcpy(stats.bytes, scm->copied.bytes, sizeof(stats.bytes));
+    scm->header->stats = stats;
+    if (flush(scm, (char *)scm->base + scm->header->compact, n) ||
+        flush(scm, scm->header, sizeof(struct header)))
     {
-        TRACE("mmap() failed");
-        close(fd);
-        free(scm);
-        return NULL;
+        /* the copy is not safe */
+        TRACE("cannot make the compaction copy durable");
+        scm_compact_abort(scm);
+        return -1;
+    }
+    scm->header->moving = n;
+    if (flush(scm, &scm->header->moving, sizeof(size_t)))
+    {
+        scm->header->moving = 0;
+        scm_compact_abort(scm);
+        return -1;
     }
+    pthread_mutex_lock(&scm->lock);
+    relocate(scm);
+    scm->opened = scm->header->stats;
+    memset(&scm->stats, 0, sizeof(struct scm_stats));
+    for (cache = scm->caches; cache; cache = cache->next)
+    {
+        memset(&cache->stats, 0, sizeof(struct scm_stats));
+    }
+    pthread_mutex_unlock(&scm->lock);
+    memset(&scm->copied, 0, sizeof(struct scm_stats));
+    scm->compacting = 0;
+    return 0;
+}
 
-    if (!truncate)
+/**
+ * Drops the blocks allocated since scm_compact_begin(), leaving the
+ * region as it was.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ */
+
+void scm_compact_abort(struct scm *scm)
+{
+    assert(scm);
+
+    if (scm->compacting)
     {
-        /* if not truncate, read the utilized in the header, use size_t space */
-        scm->utilized = *(size_t *)scm->base;
+        __atomic_store_n(&scm->header->utilized, scm->header->compact - sizeof(struct header), __ATOMIC_RELEASE);
+        scm->header->compact = 0;
+        flush(scm, scm->header, sizeof(struct header));
+        memset(&scm->copied, 0, sizeof(struct scm_stats));
+        scm->compacting = 0;
     }
-    else
+}
+
+/**
+ * Returns the number of SCM bytes utilized thus far.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of bytes utilized thus far
+ */
+
+size_t scm_utilized(const struct scm *scm)
+{
+    if (scm)
     {
-        /* if truncate, store the utilized in the header, use size_t space */
-        scm->utilized = 0;
-        *(size_t *)scm->base = scm->utilized;
+        return scm->header->utilized - scm->header->freed;
     }
 
-    scm->fd = fd;
-    scm->size = info.st_size;
+    return 0;
+}
 
-    return scm;
+/**
+ * Returns the number of SCM bytes sitting in freed blocks, i.e., space
+ * that can only be reused by requests that fit into those blocks.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of free-list bytes, block headers included
+ */
+
+size_t scm_free_bytes(const struct scm *scm)
+{
+    if (scm)
+    {
+        return scm->header->freed;
+    }
+
+    return 0;
 }
 
 /**
- * Closes a previously opened SCM handle.
- * Before closing, the SCM region is synced to the disk.
+ * Returns the number of freed blocks awaiting reuse.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  *
- * Note: scm may be NULL
+ * return: the number of free blocks
  */
 
-void scm_close(struct scm *scm)
+size_t scm_free_blocks(const struct scm *scm)
 {
     if (scm)
     {
-        if (msync(scm->base, scm->size, MS_SYNC) == -1)
+        return scm->header->blocks;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the size of the largest freed block, i.e., the largest request
+ * that can be served without bumping. Together with scm_free_bytes() this
+ * gives the external fragmentation as 1 - largest / free bytes.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the largest free block in bytes, block headers included
+ */
+
+size_t scm_largest_free(const struct scm *scm)
+{
+    size_t largest, next, b;
+
+    if (!scm)
+    {
+        return 0;
+    }
+
+    largest = 0;
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        for (b = BINS; b && !largest; --b)
         {
-            TRACE("msync error");
+            /* bins are sorted, the largest block is at the tail */
+            for (next = scm->header->bins[b - 1]; next; next = block_at(scm, next)[1])
+            {
+                largest = block_at(scm, next)[0] & ~(size_t)FIT_FLAGS;
+            }
         }
-
-        if (munmap(scm->base, scm->size) == -1)
+        return largest;
+    }
+    for (next = scm->header->free[LARGE]; next; next = block_at(scm, next)[1])
+    {
+        if (largest < block_at(scm, next)[0] + sizeof(size_t))
         {
-            TRACE("munmap error");
+            largest = block_at(scm, next)[0] + sizeof(size_t);
+        }
+    }
+    for (b = CLASSES; b && !largest; --b)
+    {
+        if (scm->header->free[b - 1])
+        {
+            largest = b * GRANULE + sizeof(size_t);
         }
+    }
+    return largest;
+}
 
-        close(scm->fd);
+/**
+ * Returns the number of SCM bytes available in total.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of bytes available in total
+ */
 
-        memset(scm, 0, sizeof(struct scm));
-        free(scm);
+size_t scm_capacity(const struct scm *scm)
+{
+    if (scm)
+    {
+        return scm->size - sizeof(struct header) - scm_utilized(scm);
     }
 
-    return;
+    return 0;
 }
 
 /**
- * Analogous to the standard C malloc function, but using SCM region.
- * Allocate memory for input word(size n).
+ * Punches a hole in the backing file under every whole page that lies
+ * inside a free block, so that disk and page cache usage follow the live
+ * data rather than the high-water mark. Only blocks larger than a page
+ * qualify: the first-fit list of SCM_ALLOC_CLASS, any SCM_ALLOC_FIT bin.
+ * Must not be called while a transaction is open.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
- * n  : the size of the requested memory in bytes
  *
- * return: a pointer to the start of the allocated memory or NULL on error
+ * return: the number of bytes released
  */
 
-void *scm_malloc(struct scm *scm, size_t n)
+size_t scm_punch(struct scm *scm)
 {
-    void *pos = NULL;
-    size_t *blockSize;
+    size_t b, next, size, bytes, n;
+    size_t *block;
 
-    if (!scm || n == 0)
+    assert(scm);
+
+    if (scm->tx)
     {
-        TRACE("invalid input");
-        return NULL;
+        TRACE("transaction open");
+        return 0;
+    }
+    bytes = 0;
+    pthread_mutex_lock(&scm->lock);
+    if (SCM_ALLOC_FIT == scm->header->mode)
+    {
+        /* keep the tag, both links and the footer */
+        for (b = bin_of(scm->page); b < BINS; ++b)
+        {
+            for (next = scm->header->bins[b]; next; next = block[1])
+            {
+                block = block_at(scm, next);
+                size = block[0] & ~(size_t)FIT_FLAGS;
+                n = punch(scm, next + 3 * sizeof(size_t), next + size - sizeof(size_t));
+                bytes += n;
+                /* scm_calloc() trusts the tag for every whole page, pinned ones are skipped */
+                if (n && (n == (next + size - sizeof(size_t)) / scm->page * scm->page -
+                                   (next + 3 * sizeof(size_t) + scm->page - 1) / scm->page * scm->page))
+                {
+                    put(scm, &block[0], block[0] | FIT_PUNCHED);
+                }
+            }
+        }
+    }
+    else
+    {
+        /* keep the size and the link */
+        for (next = scm->header->free[LARGE]; next; next = block[1])
+        {
+            block = block_at(scm, next);
+            bytes += punch(scm, next + 2 * sizeof(size_t), next + sizeof(size_t) + block[0]);
+        }
     }
+    pthread_mutex_unlock(&scm->lock);
+    return bytes;
+}
+
+/**
+ * Returns the disk space taken by the backing file, holes excluded.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of bytes allocated to the backing file
+ */
+
+size_t scm_footprint(const struct scm *scm)
+{
+    struct stat info;
 
-    if (scm->utilized + n + sizeof(size_t) > scm->size)
+    if (scm && !fstat(scm->fd, &info))
     {
-        TRACE("out of scm memory");
-        return NULL;
+        return (size_t)info.st_blocks * 512;
     }
 
-    /* calculate the position of store the size */
-    blockSize = (size_t *)((char *)scm->base + sizeof(size_t) + scm->utilized);
-    *blockSize = n;
+    return 0;
+}
 
-    /* move the pointer to the actual start of the allocated block */
-    pos = (void *)(blockSize + 1);
-    // printf("malloc pos: %p\n", pos);
-    scm->utilized += (n + sizeof(size_t));
+/**
+ * Returns the allocator statistics as of now, the last checkpoint's
+ * plus the activity of every thread since, without a heap walk.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: receives the statistics
+ */
 
-    /* update the memory header to store the new utilized value */
-    *(size_t *)scm->base = scm->utilized;
+void scm_stats(struct scm *scm, struct scm_stats *stats)
+{
+    assert(scm && stats);
 
-    return pos;
+    pthread_mutex_lock(&scm->lock);
+    tally(scm, stats);
+    pthread_mutex_unlock(&scm->lock);
 }
 
 /**
- * Analogous to the standard C strdup function, but using SCM region.
+ * Keeps the pages covering [p, p + n) resident in an SCM_BACKEND_BUFFER
+ * pool: they are marked first, so that the clock skips them once read
+ * in, then touched. POOL_FREE frames always stay unpinned.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
- * s  : a C string to be duplicated.
+ * p  : an address in the region
+ * n  : bytes from p
  *
- * return: the base memory address of the duplicated C string or NULL on error
+ * return: 0 on success, -1 if the pool has too few frames left
  */
 
-char *scm_strdup(struct scm *scm, const char *s)
+int scm_pin(struct scm *scm, const void *p, size_t n)
 {
-    char *pos = NULL;
-    size_t len;
+    volatile const char *q;
+    size_t i, from, to, more;
 
-    if (!scm || !s)
+    assert(scm);
+
+    if (!scm->pool.on || !n)
+    {
+        return 0;
+    }
+    if (((const char *)p < (const char *)scm->base) ||
+        (offset_of(scm, p) + n > __atomic_load_n(&scm->size, __ATOMIC_ACQUIRE)))
     {
         TRACE("invalid input");
-        return NULL;
+        return -1;
     }
-
-    /* plus a '\0' character to mark the end of the string */
-    len = safe_strlen(s) + 1;
-
-    if (scm->utilized + len > scm->size)
+    from = offset_of(scm, p) / scm->page;
+    to = (offset_of(scm, p) + n + scm->page - 1) / scm->page;
+    pool_lock(scm);
+    for (more = 0, i = from; i < to; ++i)
     {
-        TRACE("out of scm memory");
-        return NULL;
+        more += !bit_test(scm->pool.pinned, i);
     }
-
-    pos = scm_malloc(scm, len);
-    printf("strdup pos: %p\n", pos);
-    if (!pos)
+    if (scm->pool.stats.pinned + more + POOL_FREE > scm->pool.stats.frames)
     {
-        TRACE("scm_malloc() failed");
-        return NULL;
+        pool_unlock(scm);
+        TRACE("buffer pool exhausted");
+        return -1;
     }
-
-    printf("strdup copy string: %s\n", pos);
-    memcpy(pos, s, len);
-
-    return pos;
+    for (i = from; i < to; ++i)
+    {
+        bit_set(scm->pool.pinned, i);
+    }
+    scm->pool.stats.pinned += more;
+    pool_unlock(scm);
+    for (q = (volatile const char *)page_at(scm, from), i = 0; i < to - from; ++i)
+    {
+        (void)q[i * scm->page];
+    }
+    return 0;
 }
 
 /**
- * Analogous to the standard C free function, but using SCM region.
+ * Lets the pages covering [p, p + n) be evicted again, but those of the
+ * header.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
- * p  : a pointer to the start of a previously allocated memory
+ * p  : an address in the region
+ * n  : bytes from p
  */
 
-void scm_free(struct scm *scm, void *p)
+void scm_unpin(struct scm *scm, const void *p, size_t n)
 {
-    size_t size;
-    if (!scm || !p)
+    size_t i, from, to;
+
+    assert(scm);
+
+    if (!scm->pool.on || !n || ((const char *)p < (const char *)scm->base))
     {
-        TRACE("invalid input");
         return;
     }
+    from = offset_of(scm, p) / scm->page;
+    to = (offset_of(scm, p) + n + scm->page - 1) / scm->page;
+    pool_lock(scm);
+    for (i = (from < scm->pool.head) ? scm->pool.head : from; i < to; ++i)
+    {
+        if (bit_test(scm->pool.pinned, i))
+        {
+            bit_clear(scm->pool.pinned, i);
+            scm->pool.stats.pinned--;
+        }
+    }
+    pool_unlock(scm);
+}
 
-    size = *(size_t *)((char *)p - sizeof(size_t)); /* get the size of the block by minus the metadata*/
-
-    /* update utilized */
-    /*scm->utilized = scm->utilized - size - sizeof(size_t);*/
+/**
+ * Returns the state of the buffer pool, all zeros with SCM_BACKEND_MMAP.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: receives the frame counts and the paging activity
+ */
 
-    /* update the header information */
-    /**(size_t *)scm->base = scm->utilized;*/
+void scm_pool(struct scm *scm, struct scm_pool *stats)
+{
+    assert(scm && stats);
 
-    return;
+    memset(stats, 0, sizeof(struct scm_pool));
+    if (scm->pool.on)
+    {
+        pool_lock(scm);
+        *stats = scm->pool.stats;
+        pool_unlock(scm);
+    }
 }
 
 /**
- * Returns the number of SCM bytes utilized thus far.
+ * Tells whether the region is mapped with MAP_SYNC, see map().
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  *
- * return: the number of bytes utilized thus far
+ * return: 1 with MAP_SYNC, 0 otherwise
  */
 
-size_t scm_utilized(const struct scm *scm)
+int scm_dax(const struct scm *scm)
 {
-    if (scm)
+    assert(scm);
+
+    return scm->dax;
+}
+
+/**
+ * Finds the open region whose reserved address range contains p.
+ *
+ * p: any address
+ *
+ * return: the owning handle or NULL if p is not inside an SCM region
+ */
+
+struct scm *scm_region(const void *p)
+{
+    struct scm *scm;
+    const char *base;
+    int i;
+
+    /* lock-free, fault() calls it from a signal handler */
+    for (i = 0; i < REGIONS; ++i)
     {
-        return scm->utilized;
+        if ((scm = __atomic_load_n(&registry.slot[i], __ATOMIC_ACQUIRE)))
+        {
+            base = (const char *)scm->base;
+            if ((base <= (const char *)p) && ((const char *)p < base + scm->reserve))
+            {
+                return scm;
+            }
+        }
     }
-
-    return 0;
+    return NULL;
 }
 
 /**
- * Returns the number of SCM bytes available in total.
+ * Returns the address the SCM region is currently mapped at, i.e., the
+ * base that scm_ref_t offsets are relative to. It may differ between
+ * successive scm_open() calls on the same file.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  *
- * return: the number of bytes available in total
+ * return: the start of the mapping
  */
 
-size_t scm_capacity(const struct scm *scm)
+void *scm_base(const struct scm *scm)
 {
     if (scm)
     {
-        return scm->size - scm->utilized;
+        return scm->base;
     }
 
-    return 0;
+    return NULL;
 }
 
 /**
@@ -302,7 +5436,7 @@ void *scm_mbase(struct scm *scm)
 {
     if (scm)
     {
-        return (char *)scm->base + sizeof(size_t) + sizeof(size_t);
+        return (char *)scm->base + scm->header->root;
     }
 
     return NULL;
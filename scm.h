@@ -14,17 +14,281 @@
 
 struct scm;
 
+/**
+ * A persistent reference: the byte offset of an object from the base of
+ * its SCM region, 0 standing for NULL (offset 0 is the region header).
+ * Data structures kept in SCM store scm_ref_t instead of pointers, so that
+ * a region may be mapped at any address; SCM_PTR() and SCM_REF() convert
+ * between the two given the base returned by scm_base(); both evaluate
+ * their second argument twice.
+ */
+
+typedef uint64_t scm_ref_t;
+
+#define SCM_PTR(base, ref) \
+    ((ref) ? (void *)((char *)(base) + (ref)) : NULL)
+
+#define SCM_REF(base, p) \
+    ((p) ? (scm_ref_t)((const char *)(p) - (const char *)(base)) : 0)
+
+/**
+ * Heap layouts of an SCM region, chosen when the region is truncated.
+ *
+ * SCM_ALLOC_CLASS: exact size-class free lists, O(1) reuse of equal sizes
+ * SCM_ALLOC_FIT  : boundary-tagged best fit that splits and coalesces
+ */
+
+enum scm_allocator
+{
+    SCM_ALLOC_CLASS,
+    SCM_ALLOC_FIT
+};
+
+/**
+ * How the backing file is extended once the bump pointer reaches its end.
+ *
+ * SCM_GROW_DOUBLE: double the file size
+ * SCM_GROW_CHUNK : add scm_options.chunk bytes
+ * SCM_GROW_NONE  : fail the allocation
+ */
+
+enum scm_growth
+{
+    SCM_GROW_DOUBLE,
+    SCM_GROW_CHUNK,
+    SCM_GROW_NONE
+};
+
+/**
+ * What scm_begin() ... scm_commit() guarantees.
+ *
+ * SCM_ATOMIC_LOG : undo logging, all or nothing across process crashes
+ * SCM_ATOMIC_SYNC: as above, with ordered flushes for power failures
+ * SCM_ATOMIC_NONE: no logging, transactions are no-ops
+ */
+
+enum scm_atomicity
+{
+    SCM_ATOMIC_LOG,
+    SCM_ATOMIC_SYNC,
+    SCM_ATOMIC_NONE
+};
+
+/**
+ * How checkpoints find the pages modified since the previous one.
+ *
+ * SCM_TRACK_BITMAP   : pages written by the allocator or declared through
+ *                      scm_log(), no runtime cost besides setting a bit
+ * SCM_TRACK_WPROTECT : every write, the region is kept read-only and the
+ *                      first write to a page after a checkpoint faults
+ * SCM_TRACK_SOFTDIRTY: every write, as reported by the kernel soft-dirty
+ *                      bits of /proc/self/pagemap (CONFIG_MEM_SOFT_DIRTY)
+ */
+
+enum scm_tracking
+{
+    SCM_TRACK_BITMAP,
+    SCM_TRACK_WPROTECT,
+    SCM_TRACK_SOFTDIRTY
+};
+
+/**
+ * What scm_open() does to have the pages mapped before they are needed.
+ *
+ * SCM_PREFAULT_NONE    : nothing, every page faults on first touch
+ * SCM_PREFAULT_POPULATE: MAP_POPULATE, map the whole file up front
+ * SCM_PREFAULT_WILLNEED: MADV_WILLNEED, read the file ahead asynchronously
+ * SCM_PREFAULT_UTILIZED: map only the header and the utilized bytes
+ */
+
+enum scm_prefault
+{
+    SCM_PREFAULT_NONE,
+    SCM_PREFAULT_POPULATE,
+    SCM_PREFAULT_WILLNEED,
+    SCM_PREFAULT_UTILIZED
+};
+
+/**
+ * The access pattern announced to the kernel with madvise().
+ *
+ * SCM_ACCESS_NORMAL    : default readahead
+ * SCM_ACCESS_RANDOM    : MADV_RANDOM, no readahead, suits tree descents
+ * SCM_ACCESS_SEQUENTIAL: MADV_SEQUENTIAL, aggressive readahead
+ */
+
+enum scm_access
+{
+    SCM_ACCESS_NORMAL,
+    SCM_ACCESS_RANDOM,
+    SCM_ACCESS_SEQUENTIAL
+};
+
+/**
+ * The pages backing the mapping. A file on hugetlbfs is always mapped
+ * with the huge pages of that file system, whichever is chosen here.
+ *
+ * SCM_PAGES_BASE: base pages
+ * SCM_PAGES_HUGE: a 2 MiB aligned base and file size, and MADV_HUGEPAGE,
+ *                 so that file systems with transparent huge pages (tmpfs
+ *                 mounted with huge=advise, ...) map the region with them
+ */
+
+enum scm_pages
+{
+    SCM_PAGES_BASE,
+    SCM_PAGES_HUGE
+};
+
+/**
+ * How the backing file gets into memory.
+ *
+ * SCM_BACKEND_MMAP  : a shared mapping, the kernel page cache decides what
+ *                     stays resident and when pages are written back
+ * SCM_BACKEND_BUFFER: a pool of scm_options.pool bytes of private frames,
+ *                     read and written back by scm.c with O_DIRECT where
+ *                     the file system allows it, evicted in CLOCK order
+ *                     unless pinned, see scm_pin(); base pages only, every
+ *                     write is tracked whatever scm_options.tracking says,
+ *                     and a crash loses the frames not yet written back,
+ *                     as a power failure would with SCM_BACKEND_MMAP;
+ *                     system calls given region memory that is not
+ *                     resident fail with EFAULT, pin it or copy it first
+ */
+
+enum scm_backend
+{
+    SCM_BACKEND_MMAP,
+    SCM_BACKEND_BUFFER
+};
+
+/**
+ * How SCM_ATOMIC_SYNC transactions and scm_persist() make data durable.
+ *
+ * SCM_PERSIST_MSYNC    : msync() of the pages holding it
+ * SCM_PERSIST_CACHELINE: clwb, clflushopt or clflush of the cache lines
+ *                        holding it, then sfence; the region is mapped with
+ *                        MAP_SYNC where the file system allows it (DAX on
+ *                        persistent memory), which makes that enough; on
+ *                        any other file the same instructions run but only
+ *                        survive a process crash, and the pages stay dirty
+ *                        for the next checkpoint; SCM_BACKEND_MMAP only,
+ *                        see scm_dax()
+ */
+
+enum scm_persist
+{
+    SCM_PERSIST_MSYNC,
+    SCM_PERSIST_CACHELINE
+};
+
+struct scm_options
+{
+    enum scm_allocator allocator; /* only honored when truncating */
+    enum scm_growth growth;       /* file extension policy */
+    size_t chunk;                 /* SCM_GROW_CHUNK step, 0 for 16 MiB */
+    size_t reserve;               /* address space for growth, 0 for 1 TiB */
+    enum scm_atomicity atomicity; /* transaction guarantees */
+    enum scm_tracking tracking;   /* dirty page tracking for checkpoints */
+    unsigned flush_ms;            /* background checkpoint period, 0 for none */
+    size_t flush_bytes;           /* dirty bytes that trigger one, 0 for none */
+    enum scm_prefault prefault;   /* pages mapped by scm_open() */
+    enum scm_access access;       /* madvise() access pattern */
+    enum scm_pages pages;         /* base or huge pages */
+    size_t alignment;             /* of scm_malloc() blocks, a power of two, 0 for 8 */
+    int wal;                      /* keep a write-ahead log, see scm_wal_append() */
+    enum scm_backend backend;     /* mapping or buffer pool */
+    size_t pool;                  /* SCM_BACKEND_BUFFER bytes, 0 for 64 MiB */
+    enum scm_persist persist;     /* page or cache-line write-back */
+};
+
+/**
+ * Allocator statistics, kept in the region and brought up to date by each
+ * checkpoint: what a crash loses is the activity since the last one.
+ * Payload bytes are grouped by size class as SCM_ALLOC_CLASS sees them,
+ * 8, 16, ..., 256 bytes, then everything larger; slab objects included.
+ */
+
+#define SCM_CLASSES 33
+
+struct scm_stats
+{
+    size_t allocs;              /* blocks and objects allocated */
+    size_t frees;               /* and freed */
+    size_t bytes[SCM_CLASSES];  /* payload bytes in use, by size class */
+};
+
+/**
+ * What one checkpoint wrote back, and what it cost.
+ */
+
+struct scm_checkpoint
+{
+    size_t pages;   /* dirty pages written back */
+    size_t runs;    /* msync() calls, one per run of adjacent dirty pages */
+    double collect; /* seconds spent finding the dirty pages */
+    double sync;    /* seconds spent writing them back */
+};
+
+/**
+ * What a snapshot cost, see scm_snapshot().
+ */
+
+struct scm_snapshot
+{
+    int cloned;     /* a reflink: no byte was copied */
+    size_t size;    /* bytes of the region in the snapshot */
+    size_t bytes;   /* bytes copied, holes excluded */
+    size_t early;   /* pages copied by a thread about to write them */
+    double pause;   /* seconds scm_snapshot() held the caller */
+    double elapsed; /* seconds until the copy was complete */
+};
+
+/**
+ * The state of an SCM_BACKEND_BUFFER pool, see scm_pool().
+ */
+
+struct scm_pool
+{
+    int direct;       /* pages move with O_DIRECT, not through the page cache */
+    size_t frames;    /* pages the pool holds at most */
+    size_t resident;  /* pages it holds */
+    size_t pinned;    /* pages never evicted */
+    size_t reads;     /* pages read in */
+    size_t writes;    /* pages written back */
+    size_t evictions; /* pages dropped for others */
+    size_t refaults;  /* accesses to resident pages the clock hand passed */
+};
+
+/**
+ * What an export or an import wrote, see scm_export().
+ */
+
+struct scm_export
+{
+    size_t size;    /* bytes of the file written */
+    size_t bytes;   /* bytes of data in it, the rest are holes */
+    size_t free;    /* bytes of free blocks left out, on export */
+    double elapsed; /* seconds taken */
+};
+
 /**
  * Initializes an SCM region using the file specified in pathname as the
  * backing device, opening the regsion for memory allocation activities.
+ * Several regions may be open at once, each mapped in its own reserved
+ * address range; opening a file that is already open fails. A transaction
+ * interrupted by a crash is rolled back here. Without truncate, the file
+ * must hold a region of this build's format version; any other, and any
+ * region written before format versions existed, is refused.
  *
  * pathname: the file pathname of the backing device
  * truncate: if non-zero, truncates the SCM region, clearning all data
+ * options : open-time settings, NULL selects the defaults
  *
  * return: an opaque handle or NULL on error
  */
 
-struct scm *scm_open(const char *pathname, int truncate);
+struct scm *scm_open(const char *pathname, int truncate, const struct scm_options *options);
 
 /**
  * Closes a previously opened SCM handle.
@@ -38,6 +302,8 @@ void scm_close(struct scm *scm);
 
 /**
  * Analogous to the standard C malloc function, but using SCM region.
+ * Safe to call from several threads at once, as are scm_strdup() and
+ * scm_free(); small blocks come from per-thread caches.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  * n  : the size of the requested memory in bytes
@@ -47,6 +313,63 @@ void scm_close(struct scm *scm);
 
 void *scm_malloc(struct scm *scm, size_t n);
 
+/**
+ * Analogous to the standard C aligned_alloc function, but using SCM
+ * region. The block starts at a multiple of align, or of the default
+ * scm_options.alignment if larger, and is freed with scm_free().
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * n    : the size of the requested memory in bytes
+ * align: the alignment, a power of two
+ *
+ * return: a pointer to the start of the allocated memory or NULL on error
+ */
+
+void *scm_aligned_alloc(struct scm *scm, size_t n, size_t align);
+
+/**
+ * Allocates count objects, of the given sizes, back to back in a single
+ * block. Freeing objects[0] releases all of them; the others must not be
+ * passed to scm_free() or scm_realloc().
+ *
+ * scm    : an opaque handle previously obtained by calling scm_open()
+ * count  : the number of objects
+ * sizes  : the size of each object in bytes
+ * objects: receives the address of each object
+ *
+ * return: objects[0] or NULL on error
+ */
+
+void *scm_malloc_multi(struct scm *scm, size_t count, const size_t *sizes, void **objects);
+
+/**
+ * Analogous to the standard C calloc function, but using SCM region.
+ * Memory the region already knows to be zero, such as a never used tail
+ * or the pages under a punched block, is not written again.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * count: the number of elements
+ * size : the size of each element in bytes
+ *
+ * return: a pointer to the start of the zeroed memory or NULL on error
+ */
+
+void *scm_calloc(struct scm *scm, size_t count, size_t size);
+
+/**
+ * Analogous to the standard C realloc function, but using SCM region.
+ * The block grows in place when it ends at the allocation tail, or in
+ * SCM_ALLOC_FIT mode when the block above it is free; otherwise it moves.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : a previously allocated block, or NULL to allocate
+ * n  : the new size in bytes, 0 frees the block
+ *
+ * return: the resized block or NULL on error, p then being left untouched
+ */
+
+void *scm_realloc(struct scm *scm, void *p, size_t n);
+
 /**
  * Analogous to the standard C strdup function, but using SCM region.
  *
@@ -59,7 +382,8 @@ void *scm_malloc(struct scm *scm, size_t n);
 char *scm_strdup(struct scm *scm, const char *s);
 
 /**
- * Analogous to the standard C free function, but using SCM region.
+ * Analogous to the standard C free function, but using SCM region. The
+ * block is recycled by a later scm_malloc() of the same size class.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  * p  : a pointer to the start of a previously allocated memory
@@ -68,7 +392,369 @@ char *scm_strdup(struct scm *scm, const char *s);
 void scm_free(struct scm *scm, void *p);
 
 /**
- * Returns the number of SCM bytes utilized thus far.
+ * Allocates an object from the slabs of its size: no per-object header,
+ * objects packed in pages of their own. Up to 8 distinct sizes of at
+ * most 512 bytes may be used in a region. Sizes dividing 64 keep every
+ * object within a cache line.
+ *
+ * scm : an opaque handle previously obtained by calling scm_open()
+ * size: the size of the object in bytes
+ *
+ * return: a pointer to the object or NULL on error
+ */
+
+void *scm_slab_alloc(struct scm *scm, size_t size);
+
+/**
+ * Releases an object obtained from scm_slab_alloc(). It must not be
+ * passed to scm_free(), nor a block from scm_malloc() to this function.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : a pointer to the object
+ */
+
+void scm_slab_free(struct scm *scm, void *p);
+
+/**
+ * Arenas serve scratch objects that are all released together: no
+ * per-object header or bookkeeping, and O(1) release by scm_arena_reset().
+ * The memory comes from the region in chunks of growing size. An arena
+ * handle is private to the process and to one thread; the objects are
+ * ordinary region memory while it lives.
+ */
+
+struct scm_arena;
+
+/**
+ * Creates an arena. It must be closed before scm_compact_begin().
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * chunk: the size of the first chunk in bytes, 0 for 64 KiB
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct scm_arena *scm_arena_open(struct scm *scm, size_t chunk);
+
+/**
+ * Allocates n bytes from an arena, aligned like scm_malloc() blocks.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * n    : the size of the requested memory in bytes
+ *
+ * return: a pointer to the start of the allocated memory or NULL on error
+ */
+
+void *scm_arena_alloc(struct scm_arena *arena, size_t n);
+
+/**
+ * Releases every object of an arena in O(1), keeping its chunks for the
+ * next ones.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * punch: non-zero to also return the pages of the chunks to the file system
+ */
+
+void scm_arena_reset(struct scm_arena *arena, int punch);
+
+/**
+ * Releases every object of an arena, its chunks and the arena itself.
+ *
+ * arena: an opaque handle previously obtained by calling scm_arena_open()
+ * punch: non-zero to return the pages of the chunks to the file system first
+ */
+
+void scm_arena_close(struct scm_arena *arena, int punch);
+
+/**
+ * Opens a transaction: until scm_commit(), the updates made through
+ * scm_log() and the allocator either all survive a crash or none does.
+ * Only the calling thread may use the region while it is open.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 if a transaction is already open
+ */
+
+int scm_begin(struct scm *scm);
+
+/**
+ * Declares that the n bytes at p are about to be modified by the open
+ * transaction, saving their current content in the undo log. Without an
+ * open transaction only their pages are marked for scm_persist_all().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : the start of the range, inside the SCM region
+ * n  : the length of the range in bytes
+ */
+
+void scm_log(struct scm *scm, const void *p, size_t n);
+
+/**
+ * Commits the open transaction. In SCM_ATOMIC_SYNC mode, the pages it
+ * touched are written back first, each once, and the log is cleared
+ * only after.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_commit(struct scm *scm);
+
+/**
+ * Rolls the open transaction back, restoring every byte it modified.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ */
+
+void scm_abort(struct scm *scm);
+
+/**
+ * Synchronously writes back the pages covering the n bytes at p, and
+ * only those.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : the start of the range, inside the SCM region
+ * n  : the length of the range in bytes
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_persist(struct scm *scm, const void *p, size_t n);
+
+/**
+ * Synchronously writes back every page modified since it was last
+ * persisted, as found by scm_options.tracking. scm_close() calls it.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_persist_all(struct scm *scm);
+
+/**
+ * Same as scm_persist_all(), its cost is proportional to the number of
+ * dirty pages rather than to the size of the region.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: if not NULL, receives the page count and timings
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_checkpoint(struct scm *scm, struct scm_checkpoint *stats);
+
+/**
+ * Waits until everything written to the region before the call is
+ * durable. Callers waiting at the same time share one checkpoint of the
+ * background flusher, enabled with scm_options.flush_ms or flush_bytes;
+ * without it, the caller runs scm_persist_all().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_barrier(struct scm *scm);
+
+/**
+ * Starts a point-in-time copy of the region to pathname, between
+ * transactions: a reflink where the file system supports FICLONE, taken
+ * on the spot, otherwise a copy made by a thread while the caller goes
+ * on, each page copied before it is first written. The copy is a region
+ * that scm_open() accepts. With SCM_BACKEND_BUFFER, only a reflink.
+ *
+ * scm     : an opaque handle previously obtained by calling scm_open()
+ * pathname: the copy, created or truncated
+ * stats   : if not NULL, receives whether it was a reflink and the pause
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_snapshot(struct scm *scm, const char *pathname, struct scm_snapshot *stats);
+
+/**
+ * Waits until the copy started by scm_snapshot() is complete and durable.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: if not NULL, receives the pause, the copy time and the bytes
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_snapshot_wait(struct scm *scm, struct scm_snapshot *stats);
+
+/**
+ * Writes the header and the utilized data of the region to pathname, a
+ * file no larger than them in which free blocks and zero pages are
+ * holes, so that its size and the time taken follow the live data rather
+ * than the size of the backing file. The copy is a region that
+ * scm_open() accepts, scm_import() restores it into a file of any size.
+ * The region must be between transactions and not written by other
+ * threads meanwhile.
+ *
+ * scm     : an opaque handle previously obtained by calling scm_open()
+ * pathname: the copy, created or truncated
+ * stats   : if not NULL, receives its size, the bytes written and the time
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_export(struct scm *scm, const char *pathname, struct scm_export *stats);
+
+/**
+ * Restores the region exported to from into pathname, which must not be
+ * open: the header and the utilized data are copied, holes kept, and the
+ * file is sized to size bytes, or left at its former size when that is
+ * larger, with size 0.
+ *
+ * from    : a file written by scm_export(), or any region
+ * pathname: the region, created if need be
+ * size    : its size in bytes, 0 for its former size or just enough
+ * stats   : if not NULL, receives its size, the bytes written and the time
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_import(const char *from, const char *pathname, size_t size, struct scm_export *stats);
+
+/**
+ * Keeps the pages covering [p, p + n) resident in an SCM_BACKEND_BUFFER
+ * pool, reading them in if need be, until scm_unpin(). Pins are not
+ * counted: a page is pinned or not. A pool always keeps some frames
+ * unpinned. Does nothing with SCM_BACKEND_MMAP.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : an address in the region
+ * n  : bytes from p
+ *
+ * return: 0 on success, -1 if the pool has too few frames left
+ */
+
+int scm_pin(struct scm *scm, const void *p, size_t n);
+
+/**
+ * Lets the pages covering [p, p + n) be evicted again, see scm_pin().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * p  : an address in the region
+ * n  : bytes from p
+ */
+
+void scm_unpin(struct scm *scm, const void *p, size_t n);
+
+/**
+ * Returns the state of the buffer pool, all zeros with SCM_BACKEND_MMAP.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: receives the frame counts and the paging activity
+ */
+
+void scm_pool(struct scm *scm, struct scm_pool *stats);
+
+/**
+ * Tells whether the region is mapped with MAP_SYNC, so that flushed cache
+ * lines are durable, see SCM_PERSIST_CACHELINE.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 1 with MAP_SYNC, 0 otherwise
+ */
+
+int scm_dax(const struct scm *scm);
+
+/**
+ * The write-ahead log, enabled with scm_options.wal, makes operations
+ * durable one by one at the cost of an append and a shared fdatasync()
+ * rather than a checkpoint: each transaction appends a record of what it
+ * did, the log lives in two files next to the backing file, and every
+ * checkpoint drops the records it made redundant.
+ */
+
+typedef int (*scm_wal_fnc_t)(void *arg, int type, const void *p, size_t n);
+
+/**
+ * Appends a record as the last step of the open transaction. Without a
+ * log, nothing is written and *lsn is 0. A transaction aborted after this
+ * is replayed all the same.
+ *
+ * scm : an opaque handle previously obtained by calling scm_open()
+ * type: what the record is, passed back on replay
+ * p   : the record
+ * n   : its length in bytes
+ * lsn : receives its sequence number, to pass to scm_wal_sync()
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_wal_append(struct scm *scm, int type, const void *p, size_t n, size_t *lsn);
+
+/**
+ * Waits until the log is durable up to record lsn, callers waiting at
+ * the same time sharing one fdatasync().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * lsn: a number from scm_wal_append(), 0 returns at once
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_wal_sync(struct scm *scm, size_t lsn);
+
+/**
+ * Applies again, oldest first, the records the region does not reflect,
+ * each through fnc, which redoes its transaction including the call to
+ * scm_wal_append(). Call it right after scm_open().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ * fnc: redoes one record
+ * arg: passed to fnc
+ *
+ * return: 0 on success, -1 on error or if fnc failed
+ */
+
+int scm_wal_replay(struct scm *scm, scm_wal_fnc_t fnc, void *arg);
+
+/**
+ * Starts compacting the region. Until scm_compact_commit(), scm_malloc()
+ * places blocks back to back past everything allocated so far, in call
+ * order, and nothing may be freed. The caller copies what is live into
+ * such blocks, the one scm_mbase() must return first, and stores every
+ * reference as SCM_REF() minus *shift, where the block will end up.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * shift: receives how far the new blocks will move
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int scm_compact_begin(struct scm *scm, size_t *shift);
+
+/**
+ * Replaces the content of the region with the blocks allocated since
+ * scm_compact_begin(), moved down to the start of the data area. Every
+ * other block is dropped. Crash safe: either content survives, whole.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: 0 on success, -1 on error (the compaction is then aborted)
+ */
+
+int scm_compact_commit(struct scm *scm);
+
+/**
+ * Drops the blocks allocated since scm_compact_begin().
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ */
+
+void scm_compact_abort(struct scm *scm);
+
+/**
+ * Returns the number of SCM bytes utilized thus far. Bytes of freed blocks
+ * awaiting reuse are not counted.
  *
  * scm: an opaque handle previously obtained by calling scm_open()
  *
@@ -77,6 +763,39 @@ void scm_free(struct scm *scm, void *p);
 
 size_t scm_utilized(const struct scm *scm);
 
+/**
+ * Returns the number of SCM bytes sitting in freed blocks, i.e., space
+ * that can only be reused by requests that fit into those blocks.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of free-list bytes, block headers included
+ */
+
+size_t scm_free_bytes(const struct scm *scm);
+
+/**
+ * Returns the number of freed blocks awaiting reuse.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of free blocks
+ */
+
+size_t scm_free_blocks(const struct scm *scm);
+
+/**
+ * Returns the size of the largest freed block, i.e., the largest request
+ * that can be served without bumping. Together with scm_free_bytes() this
+ * gives the external fragmentation as 1 - largest / free bytes.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the largest free block in bytes, block headers included
+ */
+
+size_t scm_largest_free(const struct scm *scm);
+
 /**
  * Returns the number of SCM bytes available in total.
  *
@@ -87,6 +806,60 @@ size_t scm_utilized(const struct scm *scm);
 
 size_t scm_capacity(const struct scm *scm);
 
+/**
+ * Releases to the file system the whole pages lying inside free blocks,
+ * by punching holes in the backing file. Must not be called while a
+ * transaction is open.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of bytes released
+ */
+
+size_t scm_punch(struct scm *scm);
+
+/**
+ * Returns the disk space taken by the backing file, holes excluded.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the number of bytes allocated to the backing file
+ */
+
+size_t scm_footprint(const struct scm *scm);
+
+/**
+ * Returns the allocator statistics as of now, the last checkpoint's
+ * plus the activity of every thread since, without a heap walk.
+ *
+ * scm  : an opaque handle previously obtained by calling scm_open()
+ * stats: receives the statistics
+ */
+
+void scm_stats(struct scm *scm, struct scm_stats *stats);
+
+/**
+ * Finds the open region whose reserved address range contains p.
+ *
+ * p: any address
+ *
+ * return: the owning handle or NULL if p is not inside an SCM region
+ */
+
+struct scm *scm_region(const void *p);
+
+/**
+ * Returns the address the SCM region is currently mapped at, i.e., the
+ * base that scm_ref_t offsets are relative to. It may differ between
+ * successive scm_open() calls on the same file.
+ *
+ * scm: an opaque handle previously obtained by calling scm_open()
+ *
+ * return: the start of the mapping
+ */
+
+void *scm_base(const struct scm *scm);
+
 /**
  * Returns the base memory address withn the SCM region, i.e., the memory
  * pointer that would have been returned by the first call to scm_malloc()